@@ -0,0 +1,168 @@
+#include "atoms.h"
+#include <map>
+#include <vector>
+#include "log.h"
+#include "xclipboard.h"
+using namespace std;
+
+Atom XA_TARGETS;
+Atom XA_multiple;
+Atom XA_INCR;
+Atom XA_ATOM_PAIR;
+Atom XA_image_bmp;
+Atom XA_image_jpg;
+Atom XA_image_tiff;
+Atom XA_image_png;
+Atom XA_text_uri_list;
+Atom XA_text_uri;
+Atom XA_text_plain;
+Atom XA_text;
+
+Atom XA_XdndSelection;
+Atom XA_XdndAware;
+Atom XA_XdndProxy;
+Atom XA_XdndEnter;
+Atom XA_XdndLeave;
+Atom XA_XdndTypeList;
+Atom XA_XdndPosition;
+Atom XA_XdndActionCopy;
+Atom XA_XdndStatus;
+Atom XA_XdndDrop;
+Atom XA_XdndFinished;
+
+Atom XA_clipboard_daemon;
+Atom XA_clipboard_push;
+Atom XA_clipboard_shm;
+Atom XA_clipboard_zlib;
+
+struct AtomEntry
+{
+	const char* name;
+	Atom* atom;
+};
+
+//The atoms everything needs.
+static const AtomEntry standard_atoms[] =
+{
+	{"TARGETS", &XA_TARGETS},
+	{"MULTIPLE", &XA_multiple},
+	{"INCR", &XA_INCR},
+	{"ATOM_PAIR", &XA_ATOM_PAIR},
+	{"image/bmp", &XA_image_bmp},
+	{"image/jpeg", &XA_image_jpg},
+	{"image/tiff", &XA_image_tiff},
+	{"image/png", &XA_image_png},
+	{"text/uri-list", &XA_text_uri_list},
+	{"text/uri", &XA_text_uri},
+	{"text/plain", &XA_text_plain},
+	{"TEXT", &XA_text},
+	{"XdndSelection", &XA_XdndSelection},
+	{"XdndAware", &XA_XdndAware},
+	{"XdndProxy", &XA_XdndProxy},
+	{"XdndEnter", &XA_XdndEnter},
+	{"XdndLeave", &XA_XdndLeave},
+	{"XdndTypeList", &XA_XdndTypeList},
+	{"XdndPosition", &XA_XdndPosition},
+	{"XdndActionCopy", &XA_XdndActionCopy},
+	{"XdndStatus", &XA_XdndStatus},
+	{"XdndDrop", &XA_XdndDrop},
+	{"XdndFinished", &XA_XdndFinished},
+	{"_X_CLIPBOARD_DAEMON", &XA_clipboard_daemon},
+	{"_X_CLIPBOARD_PUSH", &XA_clipboard_push},
+	{"_X_CLIPBOARD_SHM", &XA_clipboard_shm},
+	{"_X_CLIPBOARD_ZLIB", &XA_clipboard_zlib},
+};
+
+//Atoms added with register_atom.
+static vector<AtomEntry> registered_atoms;
+
+//The cache of atom names. The programs only ever use one display, so
+//the atom alone is enough to identify the name.
+static map<Atom, string> atom_names;
+
+string GetAtomName(Display* disp, Atom a)
+{
+	if(a == None)
+		return "None";
+
+	map<Atom, string>::const_iterator i = atom_names.find(a);
+	if(i != atom_names.end())
+		return i->second;
+
+	//Not cached, so it has to come from the server.
+	char* name = XGetAtomName(disp, a);
+	string s = name ? name : "";
+	XFree(name);
+
+	atom_names[a] = s;
+	return s;
+}
+
+
+void register_atom(const char* name, Atom* atom)
+{
+	AtomEntry e = {name, atom};
+	registered_atoms.push_back(e);
+}
+
+
+void intern_atoms(Display* disp)
+{
+	vector<AtomEntry> entries(standard_atoms, standard_atoms + sizeof(standard_atoms) / sizeof(standard_atoms[0]));
+	entries.insert(entries.end(), registered_atoms.begin(), registered_atoms.end());
+	registered_atoms.clear();
+
+	vector<char*> names;
+	for(unsigned int i = 0; i < entries.size(); i++)
+		names.push_back(const_cast<char*>(entries[i].name));
+
+	vector<Atom> atoms(entries.size(), None);
+	XInternAtoms(disp, &names[0], names.size(), False, &atoms[0]);
+
+	for(unsigned int i = 0; i < entries.size(); i++)
+	{
+		*entries[i].atom = atoms[i];
+		atom_names[atoms[i]] = entries[i].name;
+	}
+
+	//Interning them one at a time would have taken one round trip each.
+	LOG(LOG_INFO) << "Interned " << entries.size() << " atoms in 1 round trip (rather than " << entries.size() << ").\n";
+}
+
+
+int prefetch_atom_names(Display* disp, const Atom* atoms, int n)
+{
+	//Find out which atoms we don't know about yet.
+	vector<Atom> missing;
+	for(int i = 0; i < n; i++)
+		if(atoms[i] != None && atom_names.count(atoms[i]) == 0)
+			missing.push_back(atoms[i]);
+
+	if(missing.empty())
+		return 0;
+
+	vector<char*> names(missing.size(), (char*)0);
+
+	//The atoms come from other clients (eg in TARGETS), so some may be
+	//bad. A bad atom raises BadAtom, which is fatal unless it's ignored.
+	//XGetAtomNames waits for all of its replies (and errors) before
+	//returning, so no XSync is needed before restoring the handler. It
+	//then returns zero, but the names of the good ones are still filled
+	//in.
+	int (*old_handler)(Display*, XErrorEvent*) = XSetErrorHandler(ignore_x_error);
+	Status ok = XGetAtomNames(disp, &missing[0], missing.size(), &names[0]);
+	XSetErrorHandler(old_handler);
+
+	//Bad atoms are cached with empty names, so that GetAtomName doesn't
+	//ask for them again (which would not be ignored).
+	for(unsigned int i = 0; i < missing.size(); i++)
+	{
+		atom_names[missing[i]] = names[i] ? names[i] : "";
+		XFree(names[i]);
+	}
+
+	if(!ok)
+		LOG(LOG_DEBUG) << "Some of the atoms were bad.\n";
+
+	return 1;
+}
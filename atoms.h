@@ -0,0 +1,73 @@
+#ifndef X_CLIPBOARD_ATOMS_H
+#define X_CLIPBOARD_ATOMS_H
+
+#include <X11/Xlib.h>
+#include <string>
+
+//Atoms not defined in Xatom.h, shared by both programs. These are all
+//filled in by intern_atoms.
+extern Atom XA_TARGETS;
+extern Atom XA_multiple;
+extern Atom XA_INCR;
+extern Atom XA_ATOM_PAIR;
+extern Atom XA_image_bmp;
+extern Atom XA_image_jpg;
+extern Atom XA_image_tiff;
+extern Atom XA_image_png;
+extern Atom XA_text_uri_list;
+extern Atom XA_text_uri;
+extern Atom XA_text_plain;
+extern Atom XA_text;
+
+extern Atom XA_XdndSelection;
+extern Atom XA_XdndAware;
+extern Atom XA_XdndProxy;
+extern Atom XA_XdndEnter;
+extern Atom XA_XdndLeave;
+extern Atom XA_XdndTypeList;
+extern Atom XA_XdndPosition;
+extern Atom XA_XdndActionCopy;
+extern Atom XA_XdndStatus;
+extern Atom XA_XdndDrop;
+extern Atom XA_XdndFinished;
+
+//Private atoms used to push new data to a running selection daemon.
+extern Atom XA_clipboard_daemon;
+extern Atom XA_clipboard_push;
+
+//The private target for same-machine transfers through shared memory (see
+//shared.h).
+extern Atom XA_clipboard_shm;
+
+//The private target for data compressed with zlib.
+extern Atom XA_clipboard_zlib;
+
+//Each XInternAtom call is a round trip to the server, and programs typically
+//need dozens of atoms before they can do anything. So instead, atoms are
+//registered up front and interned all together with a single XInternAtoms
+//call.
+
+//Add an atom (eg one named on the command line) to those which will be
+//interned by intern_atoms. The name must remain valid until then.
+void register_atom(const char* name, Atom* atom);
+
+//Intern all of the atoms above and any which have been registered, using a
+//single round trip. Their names go in to the name cache as well.
+void intern_atoms(Display* disp);
+
+//Atom names never change once an atom has been created, so there is no need
+//to ask the server for a name more than once. Every name fetched is kept in a
+//client side cache, so GetAtomName only costs a round trip the first time
+//an atom is seen.
+
+//Convert an atom name in to a std::string.
+std::string GetAtomName(Display* disp, Atom a);
+
+//Fetch the names of all the atoms in a list which are not already cached.
+//This uses a single XGetAtomNames call, so it costs at most one round trip
+//however long the list is. Call this before looking up the names in a list
+//of atoms (eg TARGETS) one at a time. Returns the number of round trips
+//made (0 or 1).
+int prefetch_atom_names(Display* disp, const Atom* atoms, int n);
+
+#endif
@@ -0,0 +1,139 @@
+#!/bin/bash
+#
+# Throughput and latency benchmark for paste and selection.
+#
+# This starts a private Xvfb server, runs selection as the owner of CLIPBOARD
+# with payloads from 1KB to 100MB, and pastes each one repeatedly with paste.
+# For every payload size and target it reports the median (p50) and 99th
+# percentile (p99) latency of a complete paste, the throughput at the median,
+# and the number of X round trips paste made.
+#
+# Run it with 'make bench'. The display number can be set with BENCH_DISPLAY,
+# and the number of pastes of each size is scaled by BENCH_RUNS (default 1).
+# Options for paste (eg -stream) can be given in BENCH_PASTE_FLAGS, and a
+# different paste program (eg ./paste-xcb) in BENCH_PASTE.
+
+cd "$(dirname "$0")"
+
+if ! which Xvfb > /dev/null 2>&1
+then
+	echo "Xvfb is needed to run the benchmarks." >&2
+	exit 1
+fi
+
+display=:${BENCH_DISPLAY:-73}
+scale=${BENCH_RUNS:-1}
+tmp=$(mktemp -d)
+
+Xvfb $display -nolisten tcp > /dev/null 2>&1 &
+xvfb=$!
+owner=
+
+cleanup()
+{
+	[ -n "$owner" ] && kill $owner 2> /dev/null
+	kill $xvfb 2> /dev/null
+	rm -rf "$tmp"
+}
+trap cleanup EXIT
+
+export DISPLAY=$display
+
+# Run a command every 0.1s until it succeeds, for at most 10s. Give up if
+# the process named by the second argument dies first.
+wait_for()
+{
+	local what=$1 pid=$2
+	shift 2
+
+	for i in $(seq 100)
+	do
+		"$@" && return 0
+
+		if ! kill -0 $pid 2> /dev/null
+		then
+			echo "$what exited before it was ready." >&2
+			exit 1
+		fi
+
+		sleep 0.1
+	done
+
+	echo "Timed out waiting for $what to start." >&2
+	exit 1
+}
+
+# 3 means nothing owns the selection, ie the server is up.
+server_up()
+{
+	./paste CLIPBOARD > /dev/null 2>&1
+	[ $? = 3 ]
+}
+
+# The owner is ready once the payload can be pasted.
+owner_up()
+{
+	./paste CLIPBOARD image/png > /dev/null 2>&1
+}
+
+wait_for Xvfb $xvfb server_up
+
+# Time in nanoseconds.
+now()
+{
+	date +%s%N
+}
+
+# Print the p-th percentile of the numbers on stdin.
+percentile()
+{
+	sort -n | awk -v p=$1 '{v[NR]=$1} END{i=int((NR-1)*p/100)+1; print v[i]}'
+}
+
+printf "%-10s %-14s %6s %12s %12s %12s %12s\n" size target runs "p50 (ms)" "p99 (ms)" "MB/s" "round trips"
+
+for size in 1K 64K 1M 16M 100M
+do
+	case $size in
+		1K)   bytes=1024;      runs=200;;
+		64K)  bytes=65536;     runs=200;;
+		1M)   bytes=1048576;   runs=50;;
+		16M)  bytes=16777216;  runs=10;;
+		100M) bytes=104857600; runs=5;;
+	esac
+	runs=$((runs * scale))
+
+	# The contents do not matter, since image/png is served as is.
+	payload=$tmp/payload-$size.png
+	head -c $bytes /dev/urandom > $payload
+
+	X_CLIPBOARD_LOG=0 ./selection -image $payload CLIPBOARD &
+	owner=$!
+
+	wait_for selection $owner owner_up
+
+	for target in image/png text/uri-list
+	do
+		rm -f $tmp/times
+
+		for i in $(seq $runs)
+		do
+			start=$(now)
+			X_CLIPBOARD_LOG=1 ${BENCH_PASTE:-./paste} $BENCH_PASTE_FLAGS CLIPBOARD $target 2> $tmp/log > $tmp/out
+			end=$(now)
+			echo $(( (end - start) / 1000 )) >> $tmp/times
+		done
+
+		out_bytes=$(stat -c %s $tmp/out)
+		p50=$(percentile 50 < $tmp/times)
+		p99=$(percentile 99 < $tmp/times)
+		trips=$(sed -n 's/.*using \([0-9]*\) round trips.*/\1/p' $tmp/log)
+
+		awk -v size=$size -v target=$target -v runs=$runs -v p50=$p50 -v p99=$p99 -v bytes=$out_bytes -v trips=$trips \
+			'BEGIN{printf "%-10s %-14s %6d %12.2f %12.2f %12.1f %12s\n", size, target, runs, p50/1000, p99/1000, bytes/p50, trips}'
+	done
+
+	kill $owner
+	wait $owner 2> /dev/null
+	owner=
+done
@@ -0,0 +1,540 @@
+#include "convert.h"
+#include "atoms.h"
+#include "log.h"
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <zlib.h>
+using namespace std;
+
+//The image formats we know about: the file extensions they use and the
+//name ImageMagick uses for the format.
+struct ImageFormat
+{
+	Atom* type;
+	const char* extension;
+	const char* magick_name;
+};
+
+static const ImageFormat image_formats[] =
+{
+	{&XA_image_png,  "png",  "png"},
+	{&XA_image_bmp,  "bmp",  "bmp"},
+	{&XA_image_jpg,  "jpg",  "jpeg"},
+	{&XA_image_jpg,  "jpeg", "jpeg"},
+	{&XA_image_tiff, "tiff", "tiff"},
+	{&XA_image_tiff, "tif",  "tiff"},
+};
+
+static const int num_image_formats = sizeof(image_formats) / sizeof(image_formats[0]);
+
+static const char convert_program[] = "convert";
+
+
+//Is the convert program somewhere on the PATH? This is only checked once.
+static bool have_convert_program()
+{
+	static int have = -1;
+
+	if(have == -1)
+	{
+		have = 0;
+		const char* path = getenv("PATH");
+		string dirs = path ? path : "";
+
+		for(size_t start = 0; start <= dirs.size() && !have; )
+		{
+			size_t end = dirs.find(':', start);
+			if(end == string::npos)
+				end = dirs.size();
+
+			string file = dirs.substr(start, end - start) + "/" + convert_program;
+			if(access(file.c_str(), X_OK) == 0)
+				have = 1;
+
+			start = end + 1;
+		}
+	}
+
+	return have;
+}
+
+
+//Start convert, with its stdout on a pipe, which is returned in fd. The
+//program is run directly, rather than via a shell, so the filename needs no
+//quoting.
+static bool spawn_convert(const string& source, const char* format, pid_t& pid, int& fd)
+{
+	int fds[2];
+	if(pipe(fds) == -1)
+		return false;
+
+	//Other conversions (and anything else run later) must not hold the
+	//pipe open.
+	fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+	fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+
+	pid = fork();
+
+	if(pid == -1)
+	{
+		close(fds[0]);
+		close(fds[1]);
+		return false;
+	}
+	else if(pid == 0)
+	{
+		dup2(fds[1], 1);
+		close(fds[0]);
+		close(fds[1]);
+
+		string out = string(format) + ":-";
+		execlp(convert_program, convert_program, source.c_str(), out.c_str(), (char*)0);
+		_exit(127);
+	}
+
+	close(fds[1]);
+	fd = fds[0];
+	return true;
+}
+
+
+//Once convert has closed its output, collect its exit status. It worked if
+//it exited cleanly, having written something.
+static bool convert_succeeded(pid_t pid, const string& output)
+{
+	int status = -1;
+	while(waitpid(pid, &status, 0) == -1 && errno == EINTR)
+		;
+
+	return WIFEXITED(status) && WEXITSTATUS(status) == 0 && !output.empty();
+}
+
+
+//Run convert, and wait for the converted image from its stdout.
+static bool run_convert(const string& source, const char* format, string& output)
+{
+	pid_t pid;
+	int fd;
+
+	if(!spawn_convert(source, format, pid, fd))
+		return false;
+
+	output.clear();
+	char buf[65536];
+	ssize_t n;
+	while((n = read(fd, buf, sizeof(buf))) > 0 || (n == -1 && errno == EINTR))
+		if(n > 0)
+			output.append(buf, n);
+
+	close(fd);
+
+	return convert_succeeded(pid, output);
+}
+
+
+//The file name without its extension.
+static string strip_extension(const string& filename)
+{
+	size_t dot = filename.rfind('.');
+	size_t slash = filename.rfind('/');
+
+	if(dot == string::npos || (slash != string::npos && dot < slash))
+		return filename;
+	else
+		return filename.substr(0, dot);
+}
+
+
+ConversionEngine::ConversionEngine(size_t limit)
+:source_type(None), cache_limit(limit), cache_used(0), use_count(0), data_version(0), background(0),
+ source_version(0)
+{
+}
+
+
+ConversionEngine::~ConversionEngine()
+{
+	//Nobody wants the output of conversions which are still running.
+	for(list<Running>::iterator r = running.begin(); r != running.end(); r++)
+	{
+		background->unwatch(r->fd);
+		close(r->fd);
+		kill(r->pid, SIGTERM);
+		waitpid(r->pid, 0, 0);
+	}
+}
+
+
+//The image type of a file, from its extension, or None if it's not known.
+static Atom image_type(const string& filename)
+{
+	string base = strip_extension(filename);
+	string extension = filename.size() > base.size() ? filename.substr(base.size() + 1) : "";
+
+	for(unsigned int i = 0; i < extension.size(); i++)
+		extension[i] = tolower(extension[i]);
+
+	for(int i = 0; i < num_image_formats; i++)
+		if(extension == image_formats[i].extension)
+			return *image_formats[i].type;
+
+	return None;
+}
+
+
+bool ConversionEngine::usable_source(const string& filename)
+{
+	return image_type(filename) != None && access(filename.c_str(), R_OK) == 0;
+}
+
+
+bool ConversionEngine::set_source(const string& filename)
+{
+	source_type = image_type(filename);
+
+	//Conversions of the old source are no longer valid. Ones in use by a
+	//transfer have to be kept until the transfer finishes, so they are
+	//marked as out of date and thrown away later.
+	for(list<Conversion>::iterator i = cache.begin(); i != cache.end(); i++)
+		i->current = 0;
+	evict(0);
+
+	//Conversions still running in the background are of the old source,
+	//so their output is thrown away when they finish.
+	source = filename;
+	data_version++;
+	source_version++;
+	failed.clear();
+	return source_type != None;
+}
+
+
+void ConversionEngine::add(Atom target, const Payload& data)
+{
+	fixed[target] = data;
+	data_version++;
+
+	//A compressed copy of the old data is no longer valid.
+	for(list<Conversion>::iterator i = cache.begin(); i != cache.end(); i++)
+		if(i->compressed && i->target == target)
+			i->current = 0;
+	evict(0);
+}
+
+
+vector<Atom> ConversionEngine::targets()
+{
+	vector<Atom> t;
+
+	for(PayloadStore::const_iterator i = fixed.begin(); i != fixed.end(); i++)
+		t.push_back(i->first);
+
+	if(source_type == None)
+		return t;
+
+	string base = strip_extension(source);
+
+	for(int i = 0; i < num_image_formats; i++)
+	{
+		Atom type = *image_formats[i].type;
+
+		//Some types have several extensions, so only list them once.
+		if(find(t.begin(), t.end(), type) != t.end())
+			continue;
+
+		if(type == source_type || have_convert_program() || access((base + "." + image_formats[i].extension).c_str(), R_OK) == 0)
+			t.push_back(type);
+	}
+
+	return t;
+}
+
+
+//Throw away out of date conversions, and then the least recently used
+//conversions until there is room for another needed bytes. Conversions which
+//are pinned by a transfer in progress can not be thrown away, so the cache
+//may go over the limit for a while.
+void ConversionEngine::evict(size_t needed)
+{
+	for(list<Conversion>::iterator i = cache.begin(); i != cache.end(); )
+	{
+		if(!i->current && !i->data.pinned())
+		{
+			cache_used -= i->size;
+			i = cache.erase(i);
+		}
+		else
+			i++;
+	}
+
+	while(cache_used + needed > cache_limit)
+	{
+		list<Conversion>::iterator oldest = cache.end();
+
+		for(list<Conversion>::iterator i = cache.begin(); i != cache.end(); i++)
+			if(i->size != 0 && !i->data.pinned() && (oldest == cache.end() || i->last_used < oldest->last_used))
+				oldest = i;
+
+		if(oldest == cache.end())
+			return;
+
+		LOG(LOG_INFO) << "Evicting a conversion of " << oldest->size << " bytes\n";
+		cache_used -= oldest->size;
+		cache.erase(oldest);
+	}
+}
+
+
+Payload* ConversionEngine::get(Atom target)
+{
+	if(fixed.count(target))
+		return &fixed[target];
+
+	if(source_type == None)
+		return 0;
+
+	for(list<Conversion>::iterator i = cache.begin(); i != cache.end(); i++)
+		if(i->current && !i->compressed && i->target == target)
+		{
+			i->last_used = ++use_count;
+			return &i->data;
+		}
+
+	//Not done yet, so find a way of producing it.
+	const char* magick_name = 0;
+	string file, output;
+
+	if(find_file(target, file, magick_name))
+		return add_conversion(target, "", file);
+
+	if(!magick_name || !have_convert_program() || failed.count(target))
+		return 0;
+
+	//In the background, the data arrives later.
+	if(background)
+	{
+		prepare(target);
+		return 0;
+	}
+
+	LOG(LOG_INFO) << "Converting " << source << " to " << magick_name << endl;
+
+	if(!run_convert(source, magick_name, output))
+	{
+		LOG(LOG_ERROR) << "Conversion failed.\n";
+		failed.insert(target);
+		return 0;
+	}
+
+	return add_conversion(target, output, "");
+}
+
+
+//Find a file which holds target as it is: the source itself, or a
+//pre-converted file next to it. Otherwise, magick_name is the name convert
+//uses for target, if it's an image format.
+bool ConversionEngine::find_file(Atom target, string& file, const char*& magick_name)
+{
+	string base = strip_extension(source);
+
+	if(target == source_type)
+	{
+		file = source;
+		return true;
+	}
+
+	for(int i = 0; i < num_image_formats; i++)
+		if(*image_formats[i].type == target)
+		{
+			magick_name = image_formats[i].magick_name;
+
+			if(access((base + "." + image_formats[i].extension).c_str(), R_OK) == 0)
+			{
+				file = base + "." + image_formats[i].extension;
+				LOG(LOG_INFO) << "Using pre-converted " << file << endl;
+				return true;
+			}
+		}
+
+	return false;
+}
+
+
+//Cache a conversion of the current source, which is either in output, or
+//in a file.
+Payload* ConversionEngine::add_conversion(Atom target, const string& output, const string& file)
+{
+	evict(output.size());
+	cache_used += output.size();
+
+	Conversion c;
+	c.target = target;
+	c.compressed = 0;
+	c.size = output.size();
+	c.last_used = ++use_count;
+	c.current = 1;
+	cache.push_back(c);
+
+	if(file.empty())
+		cache.back().data = Payload(output);
+	else
+		cache.back().data = Payload::from_file(file);
+
+	return &cache.back().data;
+}
+
+
+bool ConversionEngine::prepare(Atom target)
+{
+	if(!background || fixed.count(target) || source_type == None || failed.count(target))
+		return true;
+
+	for(list<Conversion>::iterator i = cache.begin(); i != cache.end(); i++)
+		if(i->current && !i->compressed && i->target == target)
+			return true;
+
+	const char* magick_name = 0;
+	string file;
+
+	if(find_file(target, file, magick_name) || !magick_name || !have_convert_program())
+		return true;
+
+	for(list<Running>::iterator r = running.begin(); r != running.end(); r++)
+		if(r->target == target && r->source_version == source_version)
+			return false;
+
+	Running r;
+	r.target = target;
+	r.source_version = source_version;
+
+	if(!spawn_convert(source, magick_name, r.pid, r.fd))
+	{
+		LOG(LOG_ERROR) << "Could not run " << convert_program << ": " << strerror(errno) << endl;
+		failed.insert(target);
+		return true;
+	}
+
+	LOG(LOG_INFO) << "Converting " << source << " to " << magick_name << " in the background.\n";
+
+	fcntl(r.fd, F_SETFL, O_NONBLOCK);
+	running.push_back(r);
+	background->watch(r.fd, POLLIN, this);
+	return false;
+}
+
+
+//Some output from a background conversion has arrived. The end of the
+//output (or an error) means that convert has finished.
+void ConversionEngine::fd_ready(int fd, short)
+{
+	for(list<Running>::iterator r = running.begin(); r != running.end(); r++)
+		if(r->fd == fd)
+		{
+			char buf[65536];
+
+			for(;;)
+			{
+				ssize_t n = read(fd, buf, sizeof(buf));
+
+				if(n > 0)
+					r->output.append(buf, n);
+				else if(n == -1 && errno == EINTR)
+					continue;
+				else if(n == -1 && errno == EAGAIN)
+					return;
+				else
+				{
+					finish_conversion(r);
+					return;
+				}
+			}
+		}
+}
+
+
+void ConversionEngine::finish_conversion(list<Running>::iterator r)
+{
+	background->unwatch(r->fd);
+	close(r->fd);
+
+	//convert has closed its output, so it has finished, or is just about
+	//to, and waiting for it is brief.
+	bool ok = convert_succeeded(r->pid, r->output);
+
+	if(r->source_version != source_version)
+		LOG(LOG_INFO) << "Discarding a conversion of an old image.\n";
+	else if(!ok)
+	{
+		LOG(LOG_ERROR) << "Conversion failed.\n";
+		failed.insert(r->target);
+	}
+	else
+	{
+		LOG(LOG_INFO) << "Background conversion of " << r->output.size() << " bytes finished.\n";
+		add_conversion(r->target, r->output, "");
+	}
+
+	running.erase(r);
+}
+
+
+Payload* ConversionEngine::get_compressed(Atom target)
+{
+	for(list<Conversion>::iterator i = cache.begin(); i != cache.end(); i++)
+		if(i->current && i->compressed && i->target == target)
+		{
+			i->last_used = ++use_count;
+			return &i->data;
+		}
+
+	Payload* data = get(target);
+
+	if(data == 0 || !data->intact())
+		return 0;
+
+	//Image data usually compresses well, and the default level is a good
+	//balance between time spent compressing and bytes saved.
+	size_t size = data->size();
+	uLongf compressed_size = compressBound(size);
+	string output(compressed_size, 0);
+
+	if(compress2((Bytef*)&output[0], &compressed_size, data->data(), size, Z_DEFAULT_COMPRESSION) != Z_OK)
+	{
+		LOG(LOG_ERROR) << "Compression failed.\n";
+		return 0;
+	}
+
+	output.resize(compressed_size);
+	LOG(LOG_INFO) << "Compressed " << size << " bytes to " << output.size() << endl;
+
+	//This may evict the uncompressed data, which is no longer needed.
+	evict(output.size());
+	cache_used += output.size();
+
+	Conversion c;
+	c.target = target;
+	c.compressed = 1;
+	c.size = output.size();
+	c.last_used = ++use_count;
+	c.current = 1;
+	cache.push_back(c);
+	cache.back().data = Payload(output);
+
+	return &cache.back().data;
+}
+
+
+void ConversionEngine::release_idle(time_t max_idle)
+{
+	release_idle_payloads(fixed, max_idle);
+
+	time_t now = time(0);
+	for(list<Conversion>::iterator i = cache.begin(); i != cache.end(); i++)
+		i->data.release_if_idle(now, max_idle);
+}
@@ -0,0 +1,137 @@
+#ifndef X_CLIPBOARD_CONVERT_H
+#define X_CLIPBOARD_CONVERT_H
+
+#include "payload.h"
+#include "loop.h"
+#include <vector>
+#include <list>
+#include <set>
+#include <string>
+#include <sys/types.h>
+
+//Rather than storing the data in every format which might be asked for, we
+//store a single source image and convert it to other image formats when (and
+//only when) a requestor asks for them. Conversions are kept in a cache, since
+//the same format is often asked for many times (eg for every paste), but the
+//cache has a limited size, and the least recently used conversions are
+//discarded to keep within it.
+//
+//A target can be produced in one of three ways:
+// 1. It's the type of the source image, so the source file is served as is.
+// 2. There is a file next to the source with the same name and the right
+//    extension (eg r0x0r.bmp next to r0x0r.png), so that is served as is.
+// 3. The image is converted with ImageMagick's convert program, if it is
+//    installed.
+//
+//Data which does not need converting (eg the URL of the image) can be added
+//as well, so that the engine can supply every target we offer.
+//
+//Running convert takes a while, and an owner which waits for it can't answer
+//anyone else (or send INCR chunks) in the mean time. So if the engine is
+//given an event loop, convert is run in the background instead, with its
+//output collected as it arrives. The owner calls prepare for the targets a
+//request needs, and if any are still being converted, answers the request
+//later, once they have finished. Conversions which fail are not tried again
+//until the source changes.
+//
+//Any target can also be supplied compressed with zlib, for requestors on
+//the other end of a slow connection. The compressed data is produced on the
+//first request, and kept in the cache along with the conversions. (The owner
+//compresses large data itself as it is sent, rather than asking for it
+//here.)
+class ConversionEngine: public FdWatcher
+{
+	public:
+		ConversionEngine(size_t cache_limit);
+		~ConversionEngine();
+
+		//Run conversions in the background, watching their output on
+		//loop. Without a loop, get waits for conversions to finish.
+		void run_in_background(EventLoop* loop) { background = loop; }
+		bool in_background() const { return background; }
+
+		//Set the image which all image targets are produced from. This
+		//discards all previous conversions. Returns false if the image
+		//type can not be deduced from the extension.
+		bool set_source(const std::string& filename);
+
+		//Whether filename can be read, and its type deduced from the
+		//extension, so that it would make a usable source. Nothing is
+		//changed, so this can be checked before giving up the old source.
+		static bool usable_source(const std::string& filename);
+
+		//Add data which is supplied as is, for the given target.
+		void add(Atom target, const Payload& data);
+
+		//All of the targets which we can supply.
+		std::vector<Atom> targets();
+
+		//Get the data for a target, converting it on the first request.
+		//Returns 0 if the data can not be produced. The payload remains
+		//valid until it is next evicted from the cache, which does not
+		//happen while it is pinned.
+		Payload* get(Atom target);
+
+		//Returns true if get can supply target (or refuse it) without
+		//waiting. Otherwise a background conversion is started if one
+		//isn't already running, and prepare should be called again once
+		//it has finished. Always true without a loop.
+		bool prepare(Atom target);
+
+		//As get, but compressed with zlib.
+		Payload* get_compressed(Atom target);
+
+		//Release file mappings which have not been used recently.
+		void release_idle(time_t max_idle);
+
+		//Changes every time the data does, so that anything derived from
+		//it knows when to throw it away.
+		unsigned long version() const { return data_version; }
+
+		//Collects the output of background conversions.
+		void fd_ready(int fd, short revents);
+
+	private:
+		struct Conversion
+		{
+			Atom target;
+			bool compressed;
+			Payload data;
+			size_t size;              //Bytes of memory used (0 for files)
+			unsigned long last_used;
+			bool current;             //False if it's from an old source
+		};
+
+		//A run of convert in the background.
+		struct Running
+		{
+			Atom target;
+			pid_t pid;
+			int fd;                   //convert's stdout
+			std::string output;
+			unsigned long source_version;
+		};
+
+		void evict(size_t needed);
+		bool find_file(Atom target, std::string& file, const char*& magick_name);
+		Payload* add_conversion(Atom target, const std::string& output, const std::string& file);
+		void finish_conversion(std::list<Running>::iterator r);
+
+		PayloadStore fixed;
+		std::string source;
+		Atom source_type;
+
+		//A list is used, since the payloads must not move when other
+		//conversions are added or removed.
+		std::list<Conversion> cache;
+		size_t cache_limit, cache_used;
+		unsigned long use_count;
+		unsigned long data_version;
+
+		EventLoop* background;
+		std::list<Running> running;
+		std::set<Atom> failed;                //Failed conversions of the current source
+		unsigned long source_version;         //Changes with the source
+};
+
+#endif
@@ -0,0 +1,717 @@
+#include "dnd.h"
+#include "atoms.h"
+#include "log.h"
+#include "metrics.h"
+#include "loop.h"
+#include <X11/Xatom.h>
+#include <cstring>
+#include <cstdlib>
+#include <vector>
+#include <X11/cursorfont.h>
+using namespace std;
+
+
+//The three states of Xdnd: we're over a window which does not
+//know about XDnD, we're over a window which does know, but won't
+//allow a drop (because we offer no suitable datatype), or we're
+//over a window which will accept a drop.
+#define UNAWARE 0
+#define UNRECEPTIVE 1
+#define CAN_DROP 2
+
+//How long to wait for the XdndStatus which answers an XdndPosition before
+//sending the next one anyway, in milliseconds. A target which never answers
+//would otherwise never hear about the pointer moving again.
+static const int position_timeout = 500;
+
+
+bool proxy_root(Display* disp, Window root, Window w)
+{
+	//Set up the root window
+	XGrabServer(disp);
+	//Check for the existence of XdndProxy
+	Property p = read_property(disp, root, XA_XdndProxy);
+
+	if(p.type == None)
+	{
+		//Property does not exist, so set it to redirect to me
+		XChangeProperty(disp, root, XA_XdndProxy, XA_WINDOW, 32, PropModeReplace, (unsigned char*)&w, 1);
+		//Set the proxy on me to point to me (as per the spec)
+		XChangeProperty(disp, w, XA_XdndProxy, XA_WINDOW, 32, PropModeReplace, (unsigned char*)&w, 1);
+	}
+	else
+	{
+		if(p.type == XA_WINDOW && p.format == 32 && p.nitems == 1)
+			LOG(LOG_ERROR) << "Root already proxied to 0x" << hex << *(unsigned long*)p.data << dec << endl;
+		else
+			LOG(LOG_ERROR) << "Root already proxied to <malformed>\n";
+	}
+
+	XUngrabServer(disp);
+
+	bool proxied = p.type == None;
+	free(p.data);
+	return proxied;
+}
+
+
+void unproxy_root(Display* disp, Window root)
+{
+	XDeleteProperty(disp, root, XA_XdndProxy);
+}
+
+
+DndTarget::DndTarget(Display* d, Window win, Window drop, Atom property, TargetPreferences& p)
+:disp(d), w(win), drop_window(drop), preferences(&p), to_be_requested(None), xdnd_version(0), source_window(None),
+ paste(d, win, property)
+{
+	//Announce XDND support
+	Atom version = 5;
+	XChangeProperty(disp, w, XA_XdndAware, XA_ATOM, 32, PropModeReplace, (unsigned char*)&version, 1);
+}
+
+
+bool DndTarget::handle_event(const XEvent& e)
+{
+	if(e.type == ClientMessage)
+	{
+		LOG(LOG_TRACE) << "A ClientMessage has arrived:\n";
+		LOG(LOG_TRACE) << "Type = " << GetAtomName(disp, e.xclient.message_type) << " (" << e.xclient.format << ")\n";
+
+		if(e.xclient.message_type == XA_XdndEnter)
+			process_enter(e);
+		else if(e.xclient.message_type == XA_XdndPosition)
+			process_position(e);
+		else if(e.xclient.message_type == XA_XdndLeave)
+		{
+			//to_be_requested = None;
+
+			//We can't actually reset to_be_requested, since OOffice always
+			//sends this event, even when it doesn't mean to.
+			LOG(LOG_DEBUG) << "Xdnd cancelled.\n";
+		}
+		else if(e.xclient.message_type == XA_XdndDrop)
+			process_drop(e);
+
+		LOG(LOG_TRACE) << endl;
+		return false;
+	}
+
+	//Once the drop has happened, the data is transferred like any other
+	//paste.
+	return paste.handle_event(e);
+}
+
+
+void DndTarget::process_enter(const XEvent& e)
+{
+	bool more_than_3 = e.xclient.data.l[1] & 1;
+	Window source = e.xclient.data.l[0];
+
+	if(LOG_ENABLED(LOG_DEBUG))
+		prefetch_atom_names(disp, (Atom*)e.xclient.data.l + 2, 3);
+
+	LOG(LOG_DEBUG) << hex << "Source window = 0x" << source << dec << endl;
+	LOG(LOG_DEBUG) << "Supports > 3 types = " << (more_than_3) << endl;
+	LOG(LOG_DEBUG) << "Protocol version = " << ( e.xclient.data.l[1] >> 24) << endl;
+	LOG(LOG_DEBUG) << "Type 1 = " << GetAtomName(disp, e.xclient.data.l[2]) << endl;
+	LOG(LOG_DEBUG) << "Type 2 = " << GetAtomName(disp, e.xclient.data.l[3]) << endl;
+	LOG(LOG_DEBUG) << "Type 3 = " << GetAtomName(disp, e.xclient.data.l[4]) << endl;
+
+	xdnd_version = ( e.xclient.data.l[1] >> 24);
+
+	//Query which conversions are available and pick the best
+
+	if(more_than_3)
+	{
+		//Fetch the list of possible conversions
+		//Notice the similarity to TARGETS with paste.
+		Property p = read_property(disp, source , XA_XdndTypeList);
+		to_be_requested = pick_target_from_targets(disp, p, *preferences);
+		free(p.data);
+	}
+	else
+	{
+		//Use the available list
+		to_be_requested = pick_target_from_atoms(disp, e.xclient.data.l[2], e.xclient.data.l[3], e.xclient.data.l[4], *preferences);
+	}
+
+
+	LOG(LOG_DEBUG) << "Requested type = " << GetAtomName(disp, to_be_requested) << endl;
+}
+
+
+void DndTarget::process_position(const XEvent& e)
+{
+	LOG(LOG_TRACE) << hex << "Source window = 0x" << e.xclient.data.l[0] << dec << endl;
+	LOG(LOG_TRACE) << "Position: x=" << (e.xclient.data.l[2]  >> 16) << " y=" << (e.xclient.data.l[2] &0xffff)  << endl;
+	LOG(LOG_TRACE) << "Timestamp = " << e.xclient.data.l[3] << " (Version >= 1 only)\n";
+
+	Atom action = XA_XdndActionCopy;
+	if(xdnd_version >= 2)
+		action = e.xclient.data.l[4];
+
+	LOG(LOG_TRACE) << "Action = " << GetAtomName(disp, action) << " (Version >= 2 only)\n";
+
+
+	//Xdnd: reply with an XDND status message
+	XClientMessageEvent m;
+	memset(&m, 0, sizeof(m));
+	m.type = ClientMessage;
+	m.display = e.xclient.display;
+	m.window = e.xclient.data.l[0];
+	m.message_type = XA_XdndStatus;
+	m.format = 32;
+	m.data.l[0] = drop_window;
+	m.data.l[1] = (to_be_requested != None);
+	m.data.l[2] = 0; //Specify an empty rectangle
+	m.data.l[3] = 0;
+	m.data.l[4] = XA_XdndActionCopy; //We only accept copying anyway.
+
+	XSendEvent(disp, e.xclient.data.l[0], False, NoEventMask, (XEvent*)&m);
+	XFlush(disp);
+}
+
+
+void DndTarget::process_drop(const XEvent& e)
+{
+	if(to_be_requested == None)
+	{
+		//It's sending anyway, despite instructions to the contrary.
+		//So reply that we're not interested.
+		XClientMessageEvent m;
+		memset(&m, 0, sizeof(m));
+		m.type = ClientMessage;
+		m.display = e.xclient.display;
+		m.window = e.xclient.data.l[0];
+		m.message_type = XA_XdndFinished;
+		m.format = 32;
+		m.data.l[0] = drop_window;
+		m.data.l[1] = 0;
+		m.data.l[2] = None; //Failed.
+		XSendEvent(disp, e.xclient.data.l[0], False, NoEventMask, (XEvent*)&m);
+	}
+	else
+	{
+		source_window = e.xclient.data.l[0];
+		if(xdnd_version >= 1)
+			paste.request(XA_XdndSelection, to_be_requested, e.xclient.data.l[2]);
+		else
+			paste.request(XA_XdndSelection, to_be_requested, CurrentTime);
+	}
+}
+
+
+void DndTarget::finish()
+{
+	bool ok = paste.state() == SelectionRequester::DONE;
+
+	XClientMessageEvent m;
+	memset(&m, 0, sizeof(m));
+	m.type = ClientMessage;
+	m.display = disp;
+	m.window = source_window;
+	m.message_type = XA_XdndFinished;
+	m.format = 32;
+	m.data.l[0] = w;
+	m.data.l[1] = ok;
+	m.data.l[2] = ok ? XA_XdndActionCopy : None; //We only ever copy.
+
+	//Reply that all is well (or not).
+	XSendEvent(disp, source_window, False, NoEventMask, (XEvent*)&m);
+	XFlush(disp);
+}
+
+
+
+//The events which keep the XdndAware cache up to date.
+static const long aware_event_mask = PropertyChangeMask | StructureNotifyMask;
+
+
+//Whether a window in the cache is being watched. Our own window (which we
+//drag from) already has its events set up. The root window is not watched,
+//since its properties change all the time (eg _NET_ACTIVE_WINDOW), so its
+//entry is only trusted for the length of a drag.
+static bool watched(Window w, Window self, Window root)
+{
+	return w != self && w != root;
+}
+
+
+//Get the XdndAware version of a window, or -1 if it is not aware.
+static int get_xdnd_version(Display* disp, Window w, Window self, Window root, XdndAwareCache& cache)
+{
+	XdndAwareCache::const_iterator c = cache.find(w);
+	if(c != cache.end())
+		return c->second;
+
+	//Watch the window, so we know when the cache entry becomes invalid.
+	if(watched(w, self, root))
+		add_event_mask(disp, w, aware_event_mask);
+
+	Atom type;
+	int fmt, version = -1;
+	unsigned long nitems, bytes_remaining;
+	unsigned char *data = 0;
+
+	if(XGetWindowProperty(disp, w, XA_XdndAware, 0, 2, False, AnyPropertyType, &type, &fmt, &nitems, &bytes_remaining, &data) != Success)
+		LOG(LOG_ERROR) << "Property read failed.\n";
+	else if(data == 0 || type == None)
+		;
+	else if(fmt != 32)
+		LOG(LOG_ERROR) << "XdndAware should be 32 bits, not " << fmt << " bits\n";
+	else if(nitems != 1)
+		LOG(LOG_ERROR) << "XdndAware should contain exactly 1 item, not " << nitems << " items\n";
+	else
+		version = *(Atom*)data;
+
+	if(data)
+		XFree(data);
+
+	cache[w] = version;
+	return version;
+}
+
+
+//Remove windows from the cache if their XdndAware property changes or they
+//are destroyed. A window which is looked at again is watched again.
+static void invalidate_xdnd_version(Display* disp, const XEvent& e, Window self, Window root, XdndAwareCache& cache)
+{
+	if(e.type == PropertyNotify && e.xproperty.atom == XA_XdndAware && cache.count(e.xproperty.window))
+	{
+		if(watched(e.xproperty.window, self, root))
+			remove_event_mask(disp, e.xproperty.window, aware_event_mask);
+
+		cache.erase(e.xproperty.window);
+	}
+	else if(e.type == DestroyNotify && cache.count(e.xdestroywindow.window))
+	{
+		forget_event_mask(e.xdestroywindow.window);
+		cache.erase(e.xdestroywindow.window);
+	}
+}
+
+
+//Once a drag has finished, stop watching the windows it went over, so that
+//we aren't woken up by every change to them until the next drag.
+static void clear_xdnd_versions(Display* disp, Window self, Window root, XdndAwareCache& cache)
+{
+	for(XdndAwareCache::const_iterator i = cache.begin(); i != cache.end(); i++)
+		if(watched(i->first, self, root))
+			remove_event_mask(disp, i->first, aware_event_mask);
+
+	cache.clear();
+}
+
+
+//Find the application's window under the pointer, at (x, y) in root window
+//coordinates. This drills down the window tree from the root, looking for a
+//window with the XdndAware property. XTranslateCoordinates gives the child
+//containing the point, so each level costs one round trip, and nothing at
+//all is needed to check for XdndAware once a window is in the cache.
+static Window find_drop_target(Display* disp, Window root, Window self, int x, int y, XdndAwareCache& cache, int& version)
+{
+	Window w = root;
+
+	for(;;)
+	{
+		version = get_xdnd_version(disp, w, self, root, cache);
+		if(version != -1)
+			return w;
+
+		Window child = None;
+		int cx, cy;
+		if(!XTranslateCoordinates(disp, root, w, x, y, &cx, &cy, &child) || child == None)
+			return None;
+
+		w = child;
+	}
+}
+
+
+DndSource::DndSource(Display* d, Window win, Window r, SelectionOwner& o, ConversionEngine& data)
+:disp(d), w(win), root(r), owner(o), typed_data(data), dragging(0), previous_window(None), previous_version(-1),
+ status(UNAWARE), position_pending(0), position_deferred(0), position_sent(0), drop_pending(0), pointer_x(0), pointer_y(0)
+{
+	silence.x = silence.y = 0;
+	silence.width = silence.height = 0;
+
+	//I think a turkey is a good choice for a program which doesn't
+	//understand Xdnd.
+	grab_bad = XCreateFontCursor(disp, XC_gobbler);
+	grab_maybe = XCreateFontCursor(disp, XC_circle);
+	grab_good = XCreateFontCursor(disp, XC_sb_down_arrow);
+}
+
+
+void DndSource::handle_event(const XEvent& e)
+{
+	if(e.type == PropertyNotify || e.type == DestroyNotify)
+	{
+		//A window has changed whether it will accept drops, or a window
+		//we know about has gone away.
+		invalidate_xdnd_version(disp, e, w, root, aware_cache);
+	}
+	else if(e.type == MotionNotify && dragging == 0)
+	{
+		if(XGrabPointer(disp, w, True, Button1MotionMask | ButtonReleaseMask, GrabModeAsync, GrabModeAsync, root, grab_bad, CurrentTime) == GrabSuccess)
+		{
+			dragging = 1;
+			owner.own(XA_XdndSelection, CurrentTime);
+			LOG(LOG_INFO) << "Begin dragging.\n\n";
+		}
+		else
+			LOG(LOG_ERROR) << "Grab failed!\n\n";
+	}
+	else if(e.type == MotionNotify && !drop_pending)
+		process_motion(e);
+	else if(dragging && !drop_pending && e.type == ButtonRelease && e.xbutton.button == 1)
+		process_button_release();
+	else if(e.type == ClientMessage && e.xclient.message_type == XA_XdndStatus)
+		process_status(e);
+	else if(e.type == ClientMessage && e.xclient.message_type == XA_XdndFinished)
+	{
+		//Check for these messages. Since out data is static, we don't need to do anything.
+		LOG(LOG_DEBUG) << "XDnDFinished event received:" << endl
+		      << "    Target window           = 0x" << hex << e.xclient.data.l[0] << dec << endl
+		      << "    Was successful          = " << (e.xclient.data.l[1] & 1)  << endl
+		      << "    Action                  = " << GetAtomName(disp, e.xclient.data.l[2]) << endl;
+
+		LOG(LOG_DEBUG) << "No action performed.\n\n";
+	}
+}
+
+
+//Is the pointer in the rectangle of silence?
+bool DndSource::in_silence() const
+{
+	return pointer_x >= silence.x && pointer_x < silence.x + silence.width &&
+	       pointer_y >= silence.y && pointer_y < silence.y + silence.height;
+}
+
+
+//Tell the target window where the pointer is (in root window coordinates).
+void DndSource::send_xdnd_position(Window target)
+{
+	XClientMessageEvent m;
+	memset(&m, 0, sizeof(m));
+	m.type = ClientMessage;
+	m.display = disp;
+	m.window = target;
+	m.message_type = XA_XdndPosition;
+	m.format = 32;
+	m.data.l[0] = w;
+	m.data.l[1] = 0;
+	m.data.l[2] = (pointer_x <<16) | pointer_y;
+	m.data.l[3] = CurrentTime; //Our data is not time dependent, so send a generic timestamp;
+	m.data.l[4] = XA_XdndActionCopy;
+
+	LOG(LOG_TRACE) << "Sending XdndPosition" << endl
+	     << "    x      = " << pointer_x << endl
+	     << "    y      = " << pointer_y << endl
+	     << "    Time   = " << m.data.l[3] << endl
+		 << "    Action = " << GetAtomName(disp, m.data.l[4]) << endl;
+
+	XSendEvent(disp, target, False, NoEventMask, (XEvent*)&m);
+	XFlush(disp);
+
+	position_pending = 1;
+	position_sent = metric_now();
+}
+
+
+double DndSource::deadline() const
+{
+	return position_pending ? position_sent + position_timeout * 1000. : 0;
+}
+
+
+bool DndSource::check_deadline(double now)
+{
+	double d = deadline();
+
+	if(d == 0 || now < d)
+		return false;
+
+	LOG(LOG_DEBUG) << "No XdndStatus from 0x" << hex << previous_window << dec << ". Not waiting any longer.\n";
+
+	//Without an answer, we don't know whether the target will take the
+	//drop where the pointer is now, so don't drop.
+	if(drop_pending)
+	{
+		position_pending = 0;
+		position_deferred = 0;
+		status = UNRECEPTIVE;
+		finish_drop();
+		return true;
+	}
+
+	//Carry on as if the reply had arrived, and send the latest position
+	//if the pointer has moved since.
+	position_pending = 0;
+
+	if(position_deferred && !in_silence() && previous_version != -1)
+		send_xdnd_position(previous_window);
+
+	position_deferred = 0;
+	return true;
+}
+
+
+void DndSource::process_motion(XEvent e)
+{
+	//The pointer generates motion events much faster than we need
+	//them, so skip to the most recent one.
+	int skipped = 0;
+	while(XCheckTypedWindowEvent(disp, w, MotionNotify, &e))
+		skipped++;
+
+	LOG(LOG_TRACE) << "Dragged pointer moved (" << skipped << " older motion events skipped): " << endl;
+
+	//XdndPosition uses root window coordinates, which the event
+	//gives us, so there's no need to ask the server.
+	pointer_x = e.xmotion.x_root;
+	pointer_y = e.xmotion.y_root;
+
+	//Look for XdndAware in the window under the pointer.
+	int version = -1;
+	Window window = find_drop_target(disp, root, w, pointer_x, pointer_y, aware_cache, version);
+	LOG(LOG_TRACE) << "Application window is: 0x" << hex << window << dec << endl;
+
+	if(version != -1)
+		LOG(LOG_TRACE) << "XDnD version is " << version << endl;
+
+	//Whether the old window would take a drop says nothing about a new one.
+	if(version == -1)
+		status = UNAWARE;
+	else if(status == UNAWARE || window != previous_window)
+		status = UNRECEPTIVE;
+
+	//Update the pointer state.
+	if(status == UNAWARE)
+		XChangeActivePointerGrab(disp, Button1MotionMask | ButtonReleaseMask, grab_bad, CurrentTime);
+	else if(status == UNRECEPTIVE)
+		XChangeActivePointerGrab(disp, Button1MotionMask | ButtonReleaseMask, grab_maybe, CurrentTime);
+	else
+		XChangeActivePointerGrab(disp, Button1MotionMask | ButtonReleaseMask, grab_good, CurrentTime);
+
+
+
+	if(window != previous_window && previous_version != -1)
+	{
+		//We've left an old, aware window.
+		LOG(LOG_DEBUG) << "Left window 0x" << hex << previous_window  << dec << ": sending XdndLeave\n";
+		send_xdnd_leave(previous_window);
+	}
+
+	if(window != previous_window && version != -1)
+	{
+		LOG(LOG_DEBUG) << "Entered window 0x" << hex << window  << dec << ": sending XdndLeave\n";
+		//We've entered a new, aware window.
+		//Send an XDnD Enter event.
+		vector<Atom> types = typed_data.targets();
+
+		XClientMessageEvent m;
+		memset(&m, 0, sizeof(m));
+		m.type = ClientMessage;
+		m.display = disp;
+		m.window = window;
+		m.message_type = XA_XdndEnter;
+		m.format = 32;
+		m.data.l[0] = w;
+		m.data.l[1] = min(5, version) << 24  |  (types.size() > 3);
+		m.data.l[2] = types.size() > 0 ? types[0] : 0;
+		m.data.l[3] = types.size() > 1 ? types[1] : 0;
+		m.data.l[4] = types.size() > 2 ? types[2] : 0;
+
+
+		LOG(LOG_DEBUG) << "   version  = " << min(5, version) << endl
+		     << "   >3 types = " << (types.size() > 3) << endl
+			 << "   Type 1   = " << GetAtomName(disp, m.data.l[2]) << endl
+			 << "   Type 2   = " << GetAtomName(disp, m.data.l[3]) << endl
+			 << "   Type 3   = " << GetAtomName(disp, m.data.l[4]) << endl;
+
+		XSendEvent(disp, window, False, NoEventMask, (XEvent*)&m);
+		XFlush(disp);
+	}
+
+	if(window != previous_window)
+	{
+		//Anything we knew about the old window no longer applies.
+		position_pending = 0;
+		position_deferred = 0;
+		silence.width = silence.height = 0;
+	}
+
+	if(version != -1)
+	{
+		//Send an XdndPosition event, unless we're waiting for the
+		//reply to the last one (in which case it's sent when the
+		//reply arrives), or the target has asked us to stay quiet
+		//while we're inside the rectangle of silence.
+		if(in_silence())
+			LOG(LOG_TRACE) << "Inside the rectangle of silence.\n";
+		else if(position_pending)
+			position_deferred = 1;
+		else
+			send_xdnd_position(window);
+	}
+
+	previous_window = window;
+	previous_version = version;
+	LOG(LOG_TRACE) << endl;
+}
+
+
+//Tell the target that the drag has left it without dropping.
+void DndSource::send_xdnd_leave(Window target)
+{
+	XClientMessageEvent m;
+	memset(&m, 0, sizeof(m));
+	m.type = ClientMessage;
+	m.display = disp;
+	m.window = target;
+	m.message_type = XA_XdndLeave;
+	m.format = 32;
+	m.data.l[0] = w;
+	m.data.l[1] = 0;
+	m.data.l[2] = 0;
+	m.data.l[3] = 0;
+	m.data.l[4] = 0;
+
+	XSendEvent(disp, target, False, NoEventMask, (XEvent*)&m);
+	XFlush(disp);
+}
+
+
+void DndSource::process_button_release()
+{
+	LOG(LOG_INFO) << "Mouse button was released.\n";
+
+	//The pointer can go, but the status we have may be for an earlier
+	//position (or window) than where it was released. So wait for the
+	//answer to the outstanding XdndPosition, and then for the answer to
+	//the final position if it was deferred.
+	XUngrabPointer(disp, CurrentTime);
+
+	if(position_pending)
+	{
+		LOG(LOG_DEBUG) << "Waiting for XdndStatus before dropping.\n";
+		drop_pending = 1;
+		return;
+	}
+
+	finish_drop();
+}
+
+
+//Drop, if the target accepts a drop where the button was released, and end
+//the drag.
+void DndSource::finish_drop()
+{
+	if(status == CAN_DROP)
+	{
+		LOG(LOG_INFO) << "Perform drop:\n";
+
+		XClientMessageEvent m;
+		memset(&m, 0, sizeof(m));
+		m.type = ClientMessage;
+		m.display = disp;
+		m.window = previous_window;
+		m.message_type = XA_XdndDrop;
+		m.format = 32;
+		m.data.l[0] = w;
+		m.data.l[1] = 0;
+		m.data.l[2] = CurrentTime; //Our data is not time dependent, so send a generic timestamp;
+		m.data.l[3] = 0;
+		m.data.l[4] = 0;
+
+		XSendEvent(disp, previous_window, False, NoEventMask, (XEvent*)&m);
+		XFlush(disp);
+	}
+	else if(previous_version != -1)
+	{
+		LOG(LOG_INFO) << "The target won't accept a drop here.\n";
+		send_xdnd_leave(previous_window);
+	}
+
+	clear_xdnd_versions(disp, w, root, aware_cache);
+	dragging = 0;
+	drop_pending = 0;
+	status = UNAWARE;
+	position_pending = 0;
+	position_deferred = 0;
+	silence.width = silence.height = 0;
+	previous_window = None;
+	previous_version = -1;
+	LOG(LOG_DEBUG) << endl;
+}
+
+
+void DndSource::process_status(const XEvent& e)
+{
+	LOG(LOG_TRACE) << "XDnDStatus event received:" << endl
+	      << "    Target window           = 0x" << hex << e.xclient.data.l[0] << dec << endl
+	      << "    Will accept             = " << (e.xclient.data.l[1] & 1)  << endl
+	      << "    No rectangle of silence = " << (e.xclient.data.l[1] & 2)  << endl
+	      << "    Rectangle of silence x  = " << (e.xclient.data.l[2] >> 16)    << endl
+	      << "    Rectangle of silence y  = " << (e.xclient.data.l[2] & 0xffff)    << endl
+	      << "    Rectangle of silence w  = " << (e.xclient.data.l[3] >> 16)    << endl
+	      << "    Rectangle of silence h  = " << (e.xclient.data.l[3] & 0xffff)    << endl
+	      << "    Action                  = " << GetAtomName(disp, e.xclient.data.l[4]) << endl;
+
+
+	if( (e.xclient.data.l[1] & 1) == 0 &&  e.xclient.data.l[4] != None)
+	{
+		LOG(LOG_TRACE) << "Action is given, even though the target won't accept a drop.\n";
+	}
+
+
+	if(dragging)
+	{
+		//Replies from a window we've already left are out of date.
+		if((Window)e.xclient.data.l[0] == previous_window)
+		{
+			if((e.xclient.data.l[1]&1) && status != UNAWARE)
+				status = CAN_DROP;
+
+			if(!(e.xclient.data.l[1]&1) && status != UNAWARE)
+				status = UNRECEPTIVE;
+
+			//Unless the target wants positions all the time, don't send
+			//them while the pointer is in the rectangle of silence.
+			if(e.xclient.data.l[1] & 2)
+				silence.width = silence.height = 0;
+			else
+			{
+				silence.x = e.xclient.data.l[2] >> 16;
+				silence.y = e.xclient.data.l[2] & 0xffff;
+				silence.width = e.xclient.data.l[3] >> 16;
+				silence.height = e.xclient.data.l[3] & 0xffff;
+			}
+
+			//The target is ready for another position. If the pointer
+			//has moved since the last one, and it's now outside the
+			//rectangle of silence, send it now.
+			position_pending = 0;
+
+			if(position_deferred && !in_silence() && previous_version != -1)
+				send_xdnd_position(previous_window);
+
+			position_deferred = 0;
+
+			//Once the final position has been answered, the drop can go
+			//ahead.
+			if(drop_pending && !position_pending)
+				finish_drop();
+		}
+	}
+
+	if(!dragging)
+		LOG(LOG_TRACE) << "Message received, but dragging is not active!\n";
+
+	if(status == UNAWARE)
+		LOG(LOG_TRACE) << "Message received, but we're not in an aware window!\n";
+
+	LOG(LOG_TRACE) << endl;
+}
@@ -0,0 +1,134 @@
+#ifndef X_CLIPBOARD_DND_H
+#define X_CLIPBOARD_DND_H
+
+#include <X11/Xlib.h>
+#include <map>
+#include "owner.h"
+#include "requester.h"
+
+//See paste.cc for a description of how XDnD works.
+
+
+//Make drops on the root window (ie the desktop) go to window w, using
+//XdndProxy. Returns false if the root window is already proxied.
+bool proxy_root(Display* disp, Window root, Window w);
+
+//Undo proxy_root.
+void unproxy_root(Display* disp, Window root);
+
+
+//The receiving end of a drag. Drops arrive in window w, which must be
+//mapped. drop_window is the window to report as the target, which is w
+//unless drops are being received on behalf of another window (eg the root
+//window, with proxy_root). The data is pasted with a SelectionRequester, in
+//the best target according to the preferences, which must last as long
+//as the DndTarget.
+//
+//Every event is handed to handle_event, which returns true once a drop has
+//finished, when requester() has the result. finish must then be called to
+//tell the source that we're done.
+class DndTarget
+{
+	public:
+		DndTarget(Display* disp, Window w, Window drop_window, Atom property, TargetPreferences& preferences);
+
+		bool handle_event(const XEvent& e);
+
+		const SelectionRequester& requester() const { return paste; }
+
+		//Once the drop has happened, the paste can time out, as for
+		//SelectionRequester.
+		void set_timeouts(const PasteTimeouts& t) { paste.set_timeouts(t); }
+		double deadline() const { return paste.deadline(); }
+		bool check_deadline(double now) { return paste.check_deadline(now); }
+
+		//Send XdndFinished, saying whether the data was pasted.
+		void finish();
+
+	private:
+		void process_enter(const XEvent& e);
+		void process_position(const XEvent& e);
+		void process_drop(const XEvent& e);
+
+		Display* disp;
+		Window w, drop_window;
+		TargetPreferences* preferences;
+
+		Atom to_be_requested;
+		int xdnd_version;
+		Window source_window;
+		SelectionRequester paste;
+};
+
+
+//Finding the window under the pointer and checking whether it knows about
+//XDnD costs round trips, and it has to be done for every movement of the
+//pointer. The XdndAware version of each window we look at is cached (with -1
+//for windows which are not aware), so that the property only has to be read
+//once. To keep the cache correct, we listen for changes to the properties of
+//the windows in it, and for them being destroyed. The cache only lasts for
+//one drag, so that we stop listening once the drag is over.
+typedef std::map<Window, int> XdndAwareCache;
+
+
+//The source of a drag. Dragging starts when the pointer is moved with the
+//button held down in window w, which must be mapped and have event_mask
+//selected. While the drag is in progress, the owner holds XdndSelection, so
+//it answers the drop target's requests for the data.
+//
+//As with the other objects, every event is handed to handle_event.
+class DndSource
+{
+	public:
+		static const long event_mask = Button1MotionMask | ButtonReleaseMask;
+
+		DndSource(Display* disp, Window w, Window root, SelectionOwner& owner, ConversionEngine& typed_data);
+
+		void handle_event(const XEvent& e);
+
+		//If the drop target doesn't answer an XdndPosition, the next one
+		//is sent anyway after a short while. When the button is released,
+		//the drop waits for the answer to the last position, so that it
+		//goes where the pointer actually is, and is abandoned if there is
+		//no answer in time. The event loop should wait
+		//no longer than deadline (on the metric_now clock, or 0 if
+		//there's nothing to wait for), and then call check_deadline,
+		//which returns true if it stopped waiting for the answer.
+		double deadline() const;
+		bool check_deadline(double now);
+
+	private:
+		void process_motion(XEvent e);
+		void process_button_release();
+		void finish_drop();
+		void process_status(const XEvent& e);
+		void send_xdnd_position(Window target);
+		void send_xdnd_leave(Window target);
+		bool in_silence() const;
+
+		Display* disp;
+		Window w, root;
+		SelectionOwner& owner;
+		ConversionEngine& typed_data;
+
+		bool dragging;                 //Are we currently dragging
+		Window previous_window;        //Window found by the last MotionNotify event.
+		int previous_version;          //XDnD version of previous_window
+		int status;
+
+		//Only one XdndPosition is allowed to be outstanding at once, and the
+		//target can give us a rectangle in which it does not need to be told
+		//about any movement.
+		bool position_pending;         //XdndPosition sent, XdndStatus not received.
+		bool position_deferred;        //The pointer moved while a position was pending.
+		double position_sent;          //When the pending position was sent.
+		bool drop_pending;             //Released, but waiting for the final XdndStatus.
+		int pointer_x, pointer_y;      //Latest pointer position, in root coordinates.
+		XRectangle silence;            //The rectangle of silence.
+		XdndAwareCache aware_cache;    //Which windows accept drops.
+
+		//Cursors for the three different XDnD states.
+		Cursor grab_bad, grab_maybe, grab_good;
+};
+
+#endif
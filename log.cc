@@ -0,0 +1,12 @@
+#include "log.h"
+#include <cstdlib>
+
+int log_level = LOG_TRACE;
+
+void init_log_level()
+{
+	const char* level = getenv("X_CLIPBOARD_LOG");
+
+	if(level)
+		log_level = atoi(level);
+}
@@ -0,0 +1,50 @@
+#ifndef X_CLIPBOARD_LOG_H
+#define X_CLIPBOARD_LOG_H
+
+#include <iostream>
+
+//Both programs describe everything they do in great detail, which is useful
+//for seeing how the protocols work, but costs a lot of time when events are
+//arriving quickly (eg during a drag). So messages are given a level, and are
+//only printed (to stderr) if the level is enabled.
+//
+//The level can be chosen at run time, by setting X_CLIPBOARD_LOG to a
+//number, and messages above MAX_LOG_LEVEL are removed at compile time, eg
+//with make LOGFLAGS=-DMAX_LOG_LEVEL=0
+//
+//Messages are written like this:
+//
+//   LOG(LOG_DEBUG) << "Target = " << GetAtomName(disp, target) << endl;
+//
+//and the arguments (including GetAtomName) are not evaluated at all unless
+//the level is enabled.
+
+#define LOG_ERROR 0   //Something has gone wrong
+#define LOG_INFO  1   //Things which happen once per operation
+#define LOG_DEBUG 2   //Details of each request and event
+#define LOG_TRACE 3   //Details of the very frequent events, eg pointer motion
+
+#ifndef MAX_LOG_LEVEL
+	#define MAX_LOG_LEVEL LOG_TRACE
+#endif
+
+//The run time level. Everything is printed by default.
+extern int log_level;
+
+//Read the run time level from the environment.
+void init_log_level();
+
+#define LOG_ENABLED(level) ((level) <= MAX_LOG_LEVEL && (level) <= log_level)
+
+//LOG is a single expression, so that it can be used safely as the body of an
+//if. The ?: means the stream expression is only evaluated if the level is
+//enabled, and since & binds less tightly than <<, LogVoidify turns the whole
+//stream expression in to void to match the other branch.
+struct LogVoidify
+{
+	void operator&(std::ostream&) {}
+};
+
+#define LOG(level) !LOG_ENABLED(level) ? (void)0 : LogVoidify() & std::cerr
+
+#endif
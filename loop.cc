@@ -0,0 +1,176 @@
+#include "loop.h"
+#include "metrics.h"
+#include <map>
+using namespace std;
+
+bool wait_for_event(Display* disp, int timeout)
+{
+	if(XPending(disp))
+		return true;
+
+	pollfd p;
+	p.fd = ConnectionNumber(disp);
+	p.events = POLLIN;
+	poll(&p, 1, timeout);
+
+	return XPending(disp);
+}
+
+
+EventLoop::EventLoop(Display* d)
+:disp(d)
+{
+	pollfd p;
+	p.fd = ConnectionNumber(disp);
+	p.events = POLLIN;
+	p.revents = 0;
+	fds.push_back(p);
+	watchers.push_back(0);
+}
+
+
+void EventLoop::watch(int fd, short events, FdWatcher* watcher)
+{
+	unwatch(fd);
+
+	pollfd p;
+	p.fd = fd;
+	p.events = events;
+	p.revents = 0;
+	fds.push_back(p);
+	watchers.push_back(watcher);
+}
+
+
+void EventLoop::unwatch(int fd)
+{
+	for(unsigned int i = 1; i < fds.size(); i++)
+		if(fds[i].fd == fd)
+		{
+			fds.erase(fds.begin() + i);
+			watchers.erase(watchers.begin() + i);
+			return;
+		}
+}
+
+
+bool EventLoop::wait(double deadline)
+{
+	for(;;)
+	{
+		//This also flushes any requests which are waiting to be sent.
+		if(XPending(disp))
+			return true;
+
+		int timeout = -1;
+		if(deadline != 0)
+		{
+			double left = deadline - metric_now();
+
+			if(left <= 0)
+				return false;
+
+			//Round up, so as not to wake up just before the deadline.
+			timeout = (int)(left / 1000) + 1;
+		}
+
+		int n = poll(&fds[0], fds.size(), timeout);
+
+		//Either the deadline has passed, or a signal arrived (eg SIGUSR1
+		//for the metrics).
+		if(n <= 0)
+			return XPending(disp);
+
+		//Watchers can change what's being watched, so work from a copy.
+		vector<pollfd> ready(fds.begin() + 1, fds.end());
+		vector<FdWatcher*> to_call(watchers.begin() + 1, watchers.end());
+		bool called = 0;
+
+		for(unsigned int i = 0; i < ready.size(); i++)
+			if(ready[i].revents)
+			{
+				to_call[i]->fd_ready(ready[i].fd, ready[i].revents);
+				called = 1;
+			}
+
+		if(called)
+			return XPending(disp);
+
+		//Otherwise the X connection is readable, but it might not be a
+		//whole event yet, in which case go round again.
+	}
+}
+
+
+//The events selected on a window: what it had to start with, and what
+//has been added since.
+struct SelectedEvents
+{
+	long original;
+	vector<long> added;
+};
+
+//As with atom names, the programs only ever use one display.
+static map<Window, SelectedEvents> selected_events;
+
+
+static long combined_mask(const SelectedEvents& s)
+{
+	long mask = s.original;
+
+	for(unsigned int i = 0; i < s.added.size(); i++)
+		mask |= s.added[i];
+
+	return mask;
+}
+
+
+void add_event_mask(Display* disp, Window w, long mask)
+{
+	map<Window, SelectedEvents>::iterator i = selected_events.find(w);
+
+	if(i == selected_events.end())
+	{
+		XWindowAttributes a;
+		SelectedEvents s;
+		s.original = XGetWindowAttributes(disp, w, &a) ? a.your_event_mask : NoEventMask;
+		i = selected_events.insert(make_pair(w, s)).first;
+	}
+
+	long before = combined_mask(i->second);
+	i->second.added.push_back(mask);
+
+	if(combined_mask(i->second) != before)
+		XSelectInput(disp, w, combined_mask(i->second));
+}
+
+
+void remove_event_mask(Display* disp, Window w, long mask)
+{
+	map<Window, SelectedEvents>::iterator i = selected_events.find(w);
+
+	if(i == selected_events.end())
+		return;
+
+	vector<long>& added = i->second.added;
+	long before = combined_mask(i->second);
+
+	for(unsigned int j = 0; j < added.size(); j++)
+		if(added[j] == mask)
+		{
+			added.erase(added.begin() + j);
+			break;
+		}
+
+	if(combined_mask(i->second) != before)
+		XSelectInput(disp, w, combined_mask(i->second));
+
+	if(added.empty())
+		selected_events.erase(i);
+}
+
+
+void forget_event_mask(Window w)
+{
+	selected_events.erase(w);
+}
@@ -0,0 +1,59 @@
+#ifndef X_CLIPBOARD_LOOP_H
+#define X_CLIPBOARD_LOOP_H
+
+#include <X11/Xlib.h>
+#include <vector>
+#include <poll.h>
+
+//Wait until there's an event to process, or timeout milliseconds have passed.
+//Returns true if there is an event.
+bool wait_for_event(Display* disp, int timeout);
+
+//Something which wants to know when a file descriptor is ready.
+class FdWatcher
+{
+	public:
+		virtual ~FdWatcher() {}
+		virtual void fd_ready(int fd, short revents) = 0;
+};
+
+
+//Waits for X events, deadlines and other file descriptors (eg control or
+//output pipes) all at once with poll, so that they can share a thread, and
+//nothing waits forever for an owner which has hung.
+class EventLoop
+{
+	public:
+		EventLoop(Display* disp);
+
+		//Wait for fd as well. events are as for poll, and can be 0 to
+		//only hear about errors and hangups (eg the other end of an
+		//output pipe being closed).
+		void watch(int fd, short events, FdWatcher* watcher);
+		void unwatch(int fd);
+
+		//Wait until there's an X event, or until the deadline (on the
+		//metric_now clock, or 0 for no deadline), handing other file
+		//descriptors to their watchers as they become ready. Returns true
+		//if there's an event. It also returns early if a signal arrives or
+		//a watcher is called, so that the caller can check on things.
+		bool wait(double deadline);
+
+	private:
+		Display* disp;
+		std::vector<pollfd> fds;            //The X connection comes first
+		std::vector<FdWatcher*> watchers;
+};
+
+
+//Select events on a window belonging to someone else (eg a requestor, or a
+//window being dragged over), without disturbing the events which anything
+//else in this process has selected on it, since XSelectInput replaces the
+//whole of this connection's event mask. The mask the window had before is
+//remembered, and put back once everything which added to it has removed what
+//it added. A window which has been destroyed should be forgotten.
+void add_event_mask(Display* disp, Window w, long mask);
+void remove_event_mask(Display* disp, Window w, long mask);
+void forget_event_mask(Window w);
+
+#endif
@@ -0,0 +1,174 @@
+#include "metrics.h"
+#include "atoms.h"
+#include <map>
+#include <string>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <unistd.h>
+using namespace std;
+
+//The buckets are powers of 2 microseconds: bucket i counts times less than
+//2^i us, and the last bucket counts everything else (more than 16 seconds).
+static const int num_buckets = 26;
+
+struct Histogram
+{
+	unsigned long count;
+	unsigned long bytes;
+	double total;
+	double max;
+	unsigned long buckets[num_buckets];
+};
+
+static const char* phase_names[NUM_PHASES] = {"targets", "convert", "read", "incr_chunk"};
+
+static map<pair<Atom, int>, Histogram> histograms;
+static Display* metrics_display;
+static const char* metrics_program = "";
+
+volatile sig_atomic_t metrics_dump_requested = 0;
+
+
+double metric_now()
+{
+	timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1e6 + t.tv_nsec / 1e3;
+}
+
+
+void record_metric(Atom target, MetricPhase phase, double start, unsigned long bytes)
+{
+	double us = metric_now() - start;
+
+	map<pair<Atom, int>, Histogram>::iterator i = histograms.find(make_pair(target, (int)phase));
+
+	if(i == histograms.end())
+	{
+		Histogram empty;
+		memset(&empty, 0, sizeof(empty));
+		i = histograms.insert(make_pair(make_pair(target, (int)phase), empty)).first;
+	}
+
+	Histogram& h = i->second;
+
+	int b = 0;
+	while(b < num_buckets - 1 && us >= (double)(1UL << b))
+		b++;
+
+	h.count++;
+	h.bytes += bytes;
+	h.total += us;
+	if(us > h.max)
+		h.max = us;
+	h.buckets[b]++;
+}
+
+
+static void handle_sigusr1(int)
+{
+	metrics_dump_requested = 1;
+}
+
+
+static void dump_metrics_at_exit()
+{
+	dump_metrics();
+}
+
+
+void init_metrics(Display* disp, const char* program)
+{
+	metrics_display = disp;
+	metrics_program = program;
+
+	signal(SIGUSR1, handle_sigusr1);
+
+	if(getenv("X_CLIPBOARD_METRICS"))
+		atexit(dump_metrics_at_exit);
+}
+
+
+void dump_metrics_if_requested()
+{
+	if(metrics_dump_requested)
+	{
+		metrics_dump_requested = 0;
+		dump_metrics();
+	}
+}
+
+
+//Atom names are chosen by whichever client interned them, so they can
+//contain anything, which has to be escaped to keep the JSON valid.
+static string json_escape(const string& s)
+{
+	string out;
+
+	for(unsigned int i = 0; i < s.size(); i++)
+	{
+		unsigned char c = s[i];
+
+		if(c == '"' || c == '\\')
+		{
+			out += '\\';
+			out += c;
+		}
+		else if(c < 0x20)
+		{
+			char buf[8];
+			snprintf(buf, sizeof(buf), "\\u%04x", c);
+			out += buf;
+		}
+		else
+			out += c;
+	}
+
+	return out;
+}
+
+
+void dump_metrics()
+{
+	const char* name = getenv("X_CLIPBOARD_METRICS");
+	FILE* f = stderr;
+
+	if(name && strcmp(name, "-") != 0)
+		f = fopen(name, "a");
+
+	if(!f)
+		return;
+
+	fprintf(f, "{\"program\":\"%s\",\"pid\":%d,\"time\":%ld,\"metrics\":[", json_escape(metrics_program).c_str(), (int)getpid(), (long)time(0));
+
+	for(map<pair<Atom, int>, Histogram>::const_iterator i = histograms.begin(); i != histograms.end(); i++)
+	{
+		const Histogram& h = i->second;
+
+		fprintf(f, "%s{\"target\":\"%s\",\"phase\":\"%s\",\"count\":%lu,\"bytes\":%lu,\"total_us\":%.0f,\"max_us\":%.0f,\"buckets\":[",
+		        i == histograms.begin() ? "" : ",",
+		        metrics_display ? json_escape(GetAtomName(metrics_display, i->first.first)).c_str() : "",
+		        phase_names[i->first.second], h.count, h.bytes, h.total, h.max);
+
+		//Each bucket is given as [upper bound in us, count]. The upper bound
+		//of the last one is infinite, which is written as null.
+		for(int b = 0; b < num_buckets; b++)
+		{
+			if(b == num_buckets - 1)
+				fprintf(f, "%s[null,%lu]", b ? "," : "", h.buckets[b]);
+			else
+				fprintf(f, "%s[%lu,%lu]", b ? "," : "", 1UL << b, h.buckets[b]);
+		}
+
+		fprintf(f, "]}");
+	}
+
+	fprintf(f, "]}\n");
+
+	if(f == stderr)
+		fflush(f);
+	else
+		fclose(f);
+}
@@ -0,0 +1,44 @@
+#ifndef X_CLIPBOARD_METRICS_H
+#define X_CLIPBOARD_METRICS_H
+
+#include <X11/Xlib.h>
+#include <csignal>
+
+//Both programs keep a latency histogram for each phase of a transfer, for
+//every target, so that it is possible to see where the time goes. Recording
+//a time costs a clock read and a few additions, so it's always on.
+//
+//The histograms are written out (as one line of JSON) when the program gets
+//SIGUSR1, and when it exits if X_CLIPBOARD_METRICS is set. They go to the
+//file named by X_CLIPBOARD_METRICS, or stderr if it's not set or is "-".
+
+enum MetricPhase
+{
+	PHASE_TARGETS,      //Replying to / waiting for a TARGETS request
+	PHASE_CONVERT,      //Converting to / waiting for a target
+	PHASE_READ,         //Reading a property
+	PHASE_INCR_CHUNK,   //One chunk of an INCR transfer, from asking for it
+	                    //(or sending it) to having read it (or it being read)
+	NUM_PHASES
+};
+
+//The current time in microseconds, from a clock which never goes backwards.
+double metric_now();
+
+//Record that a phase took from start until now, and moved bytes bytes.
+void record_metric(Atom target, MetricPhase phase, double start, unsigned long bytes = 0);
+
+//Install the SIGUSR1 handler and the exit dump. The display is used to get
+//the names of the targets.
+void init_metrics(Display* disp, const char* program);
+
+//Set by the SIGUSR1 handler.
+extern volatile sig_atomic_t metrics_dump_requested;
+
+//Write out the histograms if SIGUSR1 has arrived since the last time. The
+//event loops call this regularly, since it's not safe to do in the handler.
+void dump_metrics_if_requested();
+
+void dump_metrics();
+
+#endif
@@ -0,0 +1,765 @@
+#include "owner.h"
+#include "atoms.h"
+#include "log.h"
+#include "metrics.h"
+#include "loop.h"
+#include <X11/Xatom.h>
+#include <climits>
+#include <cstring>
+#include <vector>
+#include <zlib.h>
+using namespace std;
+
+//See process_selection_request to see how to reply to a paste.
+
+
+//The largest chunk of data we're prepared to write with a single
+//XChangeProperty. The request size is given in units of 4 bytes, and
+//includes the header of the ChangeProperty request (6 units). If the server
+//supports BIG-REQUESTS, the limit is much larger, and Xlib uses it
+//automatically, so we can go up to that.
+static size_t max_chunk_size(Display* disp)
+{
+	long max_request = XExtendedMaxRequestSize(disp);
+
+	if(max_request == 0)
+		max_request = XMaxRequestSize(disp);
+
+	//Leave a good margin for the request header.
+	return (max_request - 64) * 4;
+}
+
+
+//When several transfers are sharing the connection, the chunks are kept
+//smaller so that they take turns more often.
+static const size_t fair_chunk_size = 1 << 20;
+
+//Transfers where the requestor has not deleted the property for this many
+//milliseconds are abandoned, unless the owner is told otherwise.
+static const int default_transfer_timeout = 10000;
+
+//Compressing data takes a while, and nothing else can be answered in the
+//mean time. Anything larger than this is compressed as it's sent instead, so
+//the transfer starts straight away, and the work is spread between chunks.
+//The compressed data isn't cached then, but the uncompressed data usually
+//is.
+static const size_t eager_compression_limit = 1 << 20;
+
+//The events needed from a requestor during an INCR transfer: PropertyNotify,
+//to know when it deletes the property, and DestroyNotify, so the transfer
+//can be abandoned if the window goes away.
+static const long incr_event_mask = PropertyChangeMask | StructureNotifyMask;
+
+//How long (in seconds) to keep files mapped after they were last used.
+static const time_t payload_idle_time = 30;
+
+
+//Construct a list of targets and place them in the specified property This
+//consists of all datatypes we know of as well as TARGETS and MULTIPLE. Reading
+//this property tell the application wishing to paste which datatypes we offer.
+void set_targets_property(Display* disp, Window w, ConversionEngine& typed_data, Atom property, int offers)
+{
+
+	vector<Atom> targets; targets.push_back(XA_TARGETS);
+	targets.push_back(XA_multiple);
+
+	if(offers & OFFER_SHARED)
+		targets.push_back(XA_clipboard_shm);
+
+	if(offers & OFFER_COMPRESSED)
+		targets.push_back(XA_clipboard_zlib);
+
+
+	vector<Atom> t = typed_data.targets();
+	targets.insert(targets.end(), t.begin(), t.end());
+
+
+	if(LOG_ENABLED(LOG_DEBUG))
+	{
+		prefetch_atom_names(disp, &targets[0], targets.size());
+
+		LOG(LOG_DEBUG) << "Offering: ";
+		for(unsigned int i = 0; i < targets.size(); i++)
+			LOG(LOG_DEBUG) << GetAtomName(disp, targets[i]) << "  ";
+		LOG(LOG_DEBUG) << endl;
+	}
+
+	//Fill up this property with a list of targets.
+	XChangeProperty(disp, w, property, XA_ATOM, 32, PropModeReplace,
+					(unsigned char*)&targets[0], targets.size());
+}
+
+
+//Let go of everything a transfer was holding on to.
+static void release_incr_transfer(IncrTransfer& t)
+{
+	t.payload->unpin();
+
+	if(t.deflater)
+	{
+		deflateEnd(t.deflater);
+		delete t.deflater;
+		t.deflater = 0;
+	}
+}
+
+
+//Abandon or finish a transfer.
+static void end_incr_transfer(Display* disp, IncrTransfers& transfers, IncrTransfers::iterator i)
+{
+	Window requestor = i->first.first;
+	release_incr_transfer(i->second);
+	transfers.erase(i);
+
+	//Each transfer added to the requestor's event mask, so take this
+	//one's share away. The mask goes back to how it was once the last
+	//transfer to the requestor has finished (which matters if it's a
+	//window in this process, eg of a SelectionRequester).
+	remove_event_mask(disp, requestor, incr_event_mask);
+}
+
+
+//Begin an INCR transfer: set the property to the INCR type, with the size as
+//the value. The data gets sent when the requestor deletes the property. If
+//deflater is given, the data is compressed with it as it is sent, and the
+//transfer owns it.
+static void start_incr_transfer(Display* disp, Window requestor, Atom property, Atom target, Payload& data, IncrTransfers& transfers, z_stream* deflater)
+{
+	//We need to know when the requestor deletes the property, so we need
+	//PropertyNotify events from its window. If the window is destroyed
+	//then we need to know so the transfer can be abandoned. These are
+	//added to whatever else this connection has selected on the window.
+	//A new request on the same property replaces an old one, which has
+	//already added them.
+	IncrTransfers::iterator old = transfers.find(make_pair(requestor, property));
+	if(old == transfers.end())
+		add_event_mask(disp, requestor, incr_event_mask);
+
+	//The size is only a lower bound, so clamp it to fit in 32 bits. The size
+	//of compressed data isn't known until it's all been sent.
+	long size = deflater ? 0 : data.size() > 0x7fffffff ? 0x7fffffff : data.size();
+	XChangeProperty(disp, requestor, property, XA_INCR, 32, PropModeReplace, (unsigned char*)&size, 1);
+
+	if(old != transfers.end())
+		release_incr_transfer(old->second);
+
+	//The data must not be thrown away until the transfer is finished.
+	data.pin();
+
+	IncrTransfer t = {target, &data, 0, deflater, 0, metric_now(), 0, 0};
+	transfers[make_pair(requestor, property)] = t;
+
+	LOG(LOG_INFO) << "Starting INCR transfer of " << data.size() << " bytes. " << transfers.size() << " transfers in progress.\n";
+}
+
+
+//Every time a requestor deletes a property it's reading from, we get a
+//PropertyNotify event. If this corresponds to an INCR transfer in progress,
+//then it's ready for the next chunk. The chunk is timed from writing it to
+//here, since writing it only puts it in Xlib's buffer.
+static void process_incr_transfer(const XEvent& e, IncrTransfers& transfers)
+{
+	if(e.type != PropertyNotify || e.xproperty.state != PropertyDelete)
+		return;
+
+	IncrTransfers::iterator i = transfers.find(make_pair(e.xproperty.window, e.xproperty.atom));
+
+	if(i == transfers.end())
+		return;
+
+	IncrTransfer& t = i->second;
+	t.ready = 1;
+	t.last_active = metric_now();
+
+	if(t.chunk_sent)
+		record_metric(t.target, PHASE_INCR_CHUNK, t.chunk_sent, t.chunk_size);
+}
+
+
+//Abandon all transfers to a requestor window which has been destroyed.
+static void process_requestor_destroyed(const XEvent& e, IncrTransfers& transfers)
+{
+	if(e.type != DestroyNotify)
+		return;
+
+	for(IncrTransfers::iterator i = transfers.begin(); i != transfers.end(); )
+	{
+		if(i->first.first == e.xdestroywindow.window)
+		{
+			LOG(LOG_INFO) << "Requestor 0x" << hex << i->first.first << dec << " destroyed. Abandoning transfer.\n";
+			release_incr_transfer(i->second);
+			transfers.erase(i++);
+
+			//There's no mask to put back on a window which has gone.
+			forget_event_mask(e.xdestroywindow.window);
+		}
+		else
+			i++;
+	}
+}
+
+
+//Compress as much of the payload as fills up to size bytes of out, and
+//return how many were filled, which is 0 once the compressed data has all
+//been sent (or if compression fails, in which case the requestor finds that
+//the data is cut short).
+static size_t deflate_chunk(IncrTransfer& t, unsigned char* out, size_t size)
+{
+	const unsigned char* data = t.payload->data();
+	size_t total = t.payload->size();
+
+	t.deflater->next_out = out;
+	t.deflater->avail_out = size;
+
+	while(t.deflater->avail_out != 0)
+	{
+		//avail_in is only an unsigned int.
+		size_t left = total - t.offset;
+		size_t in = min(left, (size_t)UINT_MAX);
+		t.deflater->next_in = (Bytef*)data + t.offset;
+		t.deflater->avail_in = in;
+
+		int r = deflate(t.deflater, in == left ? Z_FINISH : Z_NO_FLUSH);
+		t.offset += in - t.deflater->avail_in;
+
+		if(r == Z_STREAM_END)
+			break;
+		else if(r != Z_OK)
+		{
+			LOG(LOG_ERROR) << "Compression failed: " << (t.deflater->msg ? t.deflater->msg : "unknown error") << endl;
+			break;
+		}
+	}
+
+	return size - t.deflater->avail_out;
+}
+
+
+//Send the next chunk to every transfer which is ready for one.
+static void run_incr_transfers(Display* disp, IncrTransfers& transfers)
+{
+	vector<unsigned char> deflated;
+
+	size_t chunk = max_chunk_size(disp);
+	if(transfers.size() > 1)
+		chunk = min(chunk, fair_chunk_size);
+
+	for(IncrTransfers::iterator i = transfers.begin(); i != transfers.end(); )
+	{
+		IncrTransfer& t = i->second;
+		Window requestor = i->first.first;
+		Atom property = i->first.second;
+
+		if(!t.ready)
+		{
+			i++;
+			continue;
+		}
+
+		//Reading a file which has been truncated would crash us, and
+		//sending the rest of one which has changed would give the
+		//requestor garbage, so give up on it. The requestor sees the
+		//transfer stop, and times out.
+		if(!t.payload->intact())
+		{
+			LOG(LOG_ERROR) << "The data for the transfer to 0x" << hex << requestor << dec << " has changed. Abandoning it.\n";
+			end_incr_transfer(disp, transfers, i++);
+			continue;
+		}
+
+		//Write the next chunk. Once all the data has been sent, this writes
+		//a zero length chunk which terminates the transfer. The data pointer
+		//is fetched every time, since the mapping may have been released
+		//between chunks.
+		size_t len;
+
+		if(t.deflater)
+		{
+			deflated.resize(chunk);
+			len = deflate_chunk(t, &deflated[0], chunk);
+			XChangeProperty(disp, requestor, property, t.target, 8, PropModeReplace, &deflated[0], len);
+		}
+		else
+		{
+			len = min(chunk, t.payload->size() - t.offset);
+			XChangeProperty(disp, requestor, property, t.target, 8, PropModeReplace, t.payload->data() + t.offset, len);
+			t.offset += len;
+		}
+
+		t.chunk_sent = metric_now();
+		t.chunk_size = len;
+		t.ready = 0;
+
+		if(len == 0)
+		{
+			LOG(LOG_INFO) << "INCR transfer to 0x" << hex << requestor << dec << " complete.\n";
+			end_incr_transfer(disp, transfers, i++);
+		}
+		else
+			i++;
+	}
+
+	XFlush(disp);
+}
+
+
+//Abandon transfers where the requestor has stopped reading.
+static void expire_incr_transfers(Display* disp, IncrTransfers& transfers, int timeout)
+{
+	double now = metric_now();
+
+	if(timeout == 0)
+		return;
+
+	for(IncrTransfers::iterator i = transfers.begin(); i != transfers.end(); )
+	{
+		if(now - i->second.last_active >= timeout * 1000.)
+		{
+			LOG(LOG_INFO) << "Transfer to 0x" << hex << i->first.first << dec << " timed out.\n";
+			end_incr_transfer(disp, transfers, i++);
+		}
+		else
+			i++;
+	}
+}
+
+
+//The private targets take the target which is actually wanted as a
+//parameter, in the property. Returns None if there isn't one.
+static Atom read_parameter(Display* disp, Window requestor, Atom property)
+{
+	Atom type;
+	int format;
+	unsigned long nitems, bytes_after;
+	unsigned char* param = 0;
+
+	if(XGetWindowProperty(disp, requestor, property, 0, 1, False, XA_ATOM,
+	                      &type, &format, &nitems, &bytes_after, &param) != Success || param == 0)
+		return None;
+
+	Atom target = nitems == 1 && format == 32 ? *(Atom*)param : None;
+	XFree(param);
+
+	LOG(LOG_DEBUG) << "Parameter = " << GetAtomName(disp, target) << endl;
+
+	return target;
+}
+
+
+//Fill up the property with the data, if it is small enough to fit in a
+//single request, otherwise send it incrementally. Returns false if the data
+//can't be read (see Payload::intact).
+static bool send_payload(Display* disp, Window requestor, Atom property, Atom type, Payload& data, IncrTransfers& transfers)
+{
+	if(!data.intact())
+	{
+		LOG(LOG_ERROR) << "The data has changed since it was loaded.\n";
+		return false;
+	}
+
+	if(data.size() > max_chunk_size(disp))
+		start_incr_transfer(disp, requestor, property, type, data, transfers, 0);
+	else
+		XChangeProperty(disp, requestor, property, type, 8, PropModeReplace, data.data(), data.size());
+
+	return true;
+}
+
+
+//Reply to _X_CLIPBOARD_SHM with a handle to a memfd holding the data for the
+//target given as the parameter.
+static bool convert_shared(Display* disp, Window requestor, Atom property, ConversionEngine& typed_data, SharedPayloads& shared)
+{
+	Atom target = read_parameter(disp, requestor, property);
+
+	double start = metric_now();
+	Payload* data = target == None ? 0 : typed_data.get(target);
+	record_metric(target, PHASE_CONVERT, start);
+
+	if(data == 0)
+		return false;
+
+	string handle = shared.handle(target, *data, typed_data.version());
+
+	if(handle.empty())
+		return false;
+
+	XChangeProperty(disp, requestor, property, XA_clipboard_shm, 8, PropModeReplace, (unsigned char*)handle.data(), handle.size());
+	return true;
+}
+
+
+//Reply to _X_CLIPBOARD_ZLIB with the data for the target given as the
+//parameter, compressed. It's sent like any other data, with type
+//_X_CLIPBOARD_ZLIB, using INCR if it's still too large. Large data is
+//always sent with INCR, compressing each chunk as it goes.
+static bool convert_compressed(Display* disp, Window requestor, Atom property, ConversionEngine& typed_data, IncrTransfers& transfers)
+{
+	Atom target = read_parameter(disp, requestor, property);
+
+	double start = metric_now();
+	Payload* data = target == None ? 0 : typed_data.get(target);
+
+	if(data != 0 && data->size() > eager_compression_limit)
+	{
+		z_stream* deflater = new z_stream;
+		memset(deflater, 0, sizeof(z_stream));
+
+		if(deflateInit(deflater, Z_DEFAULT_COMPRESSION) != Z_OK)
+		{
+			LOG(LOG_ERROR) << "Could not start compressing.\n";
+			delete deflater;
+			return false;
+		}
+
+		record_metric(XA_clipboard_zlib, PHASE_CONVERT, start);
+		start_incr_transfer(disp, requestor, property, XA_clipboard_zlib, *data, transfers, deflater);
+		return true;
+	}
+
+	data = data == 0 ? 0 : typed_data.get_compressed(target);
+	record_metric(XA_clipboard_zlib, PHASE_CONVERT, start);
+
+	if(data == 0)
+		return false;
+
+	return send_payload(disp, requestor, property, XA_clipboard_zlib, *data, transfers);
+}
+
+
+//Convert the data to the specified target and place it in the property
+//on the requestor window. Returns false if we don't know the target.
+//The private targets are only converted if they're offered.
+static bool convert_target(Display* disp, Window requestor, Atom target, Atom property, ConversionEngine& typed_data, IncrTransfers& transfers, SharedPayloads& shared, int offers)
+{
+	if(target == XA_TARGETS)
+	{
+		LOG(LOG_DEBUG) << "Replying with a target list.\n";
+		double start = metric_now();
+		set_targets_property(disp, requestor, typed_data, property, offers);
+		record_metric(target, PHASE_TARGETS, start);
+		return true;
+	}
+	else if(target == XA_clipboard_shm)
+		return (offers & OFFER_SHARED) && convert_shared(disp, requestor, property, typed_data, shared);
+	else if(target == XA_clipboard_zlib)
+		return (offers & OFFER_COMPRESSED) && convert_compressed(disp, requestor, property, typed_data, transfers);
+
+	//We're asked to convert to one of the formats we know about. This
+	//performs the conversion if it has not been done already.
+	double start = metric_now();
+	Payload* data = typed_data.get(target);
+	record_metric(target, PHASE_CONVERT, start);
+
+	if(data == 0)
+		return false;
+
+	LOG(LOG_DEBUG) << "Replying with which ever data I have" << endl;
+
+	return send_payload(disp, requestor, property, target, *data, transfers);
+}
+
+
+//Read the list of (target, property) atom pairs for a MULTIPLE request.
+//Returns false if it's malformed. Returns the type, so that it can be written
+//back the same way.
+static bool read_pairs(Display* disp, Window requestor, Atom property, vector<Atom>& pairs, Atom& type)
+{
+	int format;
+	unsigned long nitems, bytes_after;
+	unsigned char* data = 0;
+
+	//Lists of pairs are always small, so read the whole thing in one go.
+	if(XGetWindowProperty(disp, requestor, property, 0, LONG_MAX/4, False, AnyPropertyType,
+	                      &type, &format, &nitems, &bytes_after, &data) != Success || data == 0)
+		return false;
+
+	//Some programs use ATOM rather than ATOM_PAIR.
+	bool ok = (type == XA_ATOM_PAIR || type == XA_ATOM) && format == 32;
+
+	if(ok)
+		pairs.assign((Atom*)data, (Atom*)data + nitems);
+
+	XFree(data);
+	return ok;
+}
+
+
+//The targets whose data is needed to answer a request. The private targets
+//need the target given as their parameter.
+static vector<Atom> needed_targets(Display* disp, const XSelectionRequestEvent& r)
+{
+	vector<Atom> needs, pairs;
+	Atom type;
+
+	if(r.target != XA_multiple)
+	{
+		pairs.push_back(r.target);
+		pairs.push_back(r.property);
+	}
+	else if(r.property == None || !read_pairs(disp, r.requestor, r.property, pairs, type))
+		return needs;
+
+	for(unsigned int i = 0; i + 1 < pairs.size(); i += 2)
+		if(pairs[i] == XA_clipboard_shm || pairs[i] == XA_clipboard_zlib)
+			needs.push_back(pairs[i+1] == None ? None : read_parameter(disp, r.requestor, pairs[i+1]));
+		else
+			needs.push_back(pairs[i]);
+
+	return needs;
+}
+
+
+//Perform a MULTIPLE conversion. The property on the requestor contains a
+//list of (target, property) atom pairs of type ATOM_PAIR. Each of these is
+//converted in turn. The ICCCM specifies that any pair which can not be
+//converted has its property replaced by None in the list, so the list is
+//written back once everything has been converted. None of these requests
+//need a reply, so Xlib sends all of the property writes together in a
+//single batch when the SelectionNotify is flushed.
+static bool convert_multiple(Display* disp, Window requestor, Atom property, ConversionEngine& typed_data, IncrTransfers& transfers, SharedPayloads& shared, int offers)
+{
+	vector<Atom> pairs;
+	Atom type;
+
+	if(!read_pairs(disp, requestor, property, pairs, type))
+		return false;
+
+	unsigned long nitems = pairs.size();
+
+	if(LOG_ENABLED(LOG_DEBUG) && nitems)
+		prefetch_atom_names(disp, &pairs[0], nitems);
+
+	LOG(LOG_DEBUG) << "MULTIPLE request for " << nitems/2 << " targets.\n";
+
+	for(unsigned long i = 0; i + 1 < nitems; i += 2)
+	{
+		LOG(LOG_DEBUG) << "   " << GetAtomName(disp, pairs[i]) << " -> " << GetAtomName(disp, pairs[i+1]) << endl;
+
+		//Nesting MULTIPLE makes no sense, and a pair with no property
+		//can not be converted.
+		if(pairs[i] == XA_multiple || pairs[i+1] == None || !convert_target(disp, requestor, pairs[i], pairs[i+1], typed_data, transfers, shared, offers))
+		{
+			LOG(LOG_DEBUG) << "   Refused.\n";
+			pairs[i+1] = None;
+		}
+	}
+
+	XChangeProperty(disp, requestor, property, type, 32, PropModeReplace, (unsigned char*)(nitems ? &pairs[0] : 0), nitems);
+
+	return true;
+}
+
+
+SelectionOwner::SelectionOwner(Display* d, Window win, ConversionEngine& data)
+:disp(d), w(win), typed_data(data), selection(None), lost_selection(0), transfer_timeout(default_transfer_timeout), offers(0)
+{
+}
+
+
+bool SelectionOwner::own(Atom s, Time t)
+{
+	//We only hold one selection at once.
+	if(selection != None && s != selection && XGetSelectionOwner(disp, selection) == w)
+		XSetSelectionOwner(disp, selection, None, t);
+
+	selection = s;
+	lost_selection = 0;
+	XSetSelectionOwner(disp, selection, w, t);
+
+	//The ICCCM says that the ownership must be checked, since another client
+	//may have taken it with a later timestamp.
+	if(XGetSelectionOwner(disp, selection) != w)
+	{
+		LOG(LOG_ERROR) << "Failed to take ownership of the selection.\n";
+		return false;
+	}
+
+	return true;
+}
+
+
+void SelectionOwner::handle_event(const XEvent& e)
+{
+	if(e.type == SelectionClear)
+	{
+		//Transfers in progress must be allowed to finish, even though
+		//we no longer own the selection.
+		lost_selection = 1;
+		LOG(LOG_INFO) << "SelectionClear event received.\n";
+	}
+	else if(e.type == SelectionRequest)
+	{
+		//A request to paste has occured. If it needs data which is still
+		//being converted, it's answered later, by run. Finding out what's
+		//needed costs round trips, so it's only done when conversions can
+		//happen in the background.
+		vector<Atom> needs;
+		if(typed_data.in_background())
+			needs = needed_targets(disp, e.xselectionrequest);
+
+		if(prepared(needs))
+			process_selection_request(e);
+		else
+		{
+			LOG(LOG_INFO) << "Deferring a request until its conversion has finished.\n";
+			DeferredRequest d = {e, needs, metric_now()};
+			deferred.push_back(d);
+		}
+	}
+	else if(e.type == PropertyNotify)
+	{
+		//A requestor has deleted a property, so send the next chunk.
+		process_incr_transfer(e, transfers);
+	}
+	else if(e.type == DestroyNotify)
+	{
+		//A requestor has gone away in the middle of a transfer.
+		process_requestor_destroyed(e, transfers);
+	}
+}
+
+
+//Start the conversions of all the targets (which happen in the background).
+//Returns true if they have all finished.
+bool SelectionOwner::prepared(const vector<Atom>& targets)
+{
+	bool ready = 1;
+
+	for(unsigned int i = 0; i < targets.size(); i++)
+		if(targets[i] != None && !typed_data.prepare(targets[i]))
+			ready = 0;
+
+	return ready;
+}
+
+
+//Answer deferred requests, once their conversions have finished. Ones which
+//have waited too long are answered anyway, which refuses the targets which
+//aren't ready.
+void SelectionOwner::answer_deferred()
+{
+	double now = metric_now();
+
+	for(list<DeferredRequest>::iterator i = deferred.begin(); i != deferred.end(); )
+	{
+		bool expired = transfer_timeout && now - i->since >= transfer_timeout * 1000.;
+
+		if(prepared(i->needs) || expired)
+		{
+			if(expired)
+				LOG(LOG_INFO) << "Timed out waiting for a conversion.\n";
+
+			process_selection_request(i->request);
+			deferred.erase(i++);
+		}
+		else
+			i++;
+	}
+}
+
+
+void SelectionOwner::run()
+{
+	answer_deferred();
+	run_incr_transfers(disp, transfers);
+	expire_incr_transfers(disp, transfers, transfer_timeout);
+
+	//Don't hold on to file mappings (or memfds) nobody is using.
+	typed_data.release_idle(payload_idle_time);
+	shared.release_idle(payload_idle_time);
+}
+
+
+double SelectionOwner::deadline() const
+{
+	double d = metric_now() + payload_idle_time * 1e6;
+
+	if(transfer_timeout)
+	{
+		for(IncrTransfers::const_iterator i = transfers.begin(); i != transfers.end(); i++)
+			d = min(d, i->second.last_active + transfer_timeout * 1000.);
+
+		for(list<DeferredRequest>::const_iterator i = deferred.begin(); i != deferred.end(); i++)
+			d = min(d, i->since + transfer_timeout * 1000.);
+	}
+
+	return d;
+}
+
+
+//This function essentially performs the paste operation: by converting the
+//stored data in to a format acceptable to the destination and replying
+//with an acknowledgement.
+void SelectionOwner::process_selection_request(const XEvent& e)
+{
+	//Extract the relavent data
+	Window owner     = e.xselectionrequest.owner;
+	Atom selection   = e.xselectionrequest.selection;
+	Atom target      = e.xselectionrequest.target;
+	Atom property    = e.xselectionrequest.property;
+	Window requestor = e.xselectionrequest.requestor;
+	Time timestamp   = e.xselectionrequest.time;
+
+	if(LOG_ENABLED(LOG_DEBUG))
+	{
+		Atom names[] = {selection, target, property};
+		prefetch_atom_names(disp, names, 3);
+	}
+
+	LOG(LOG_DEBUG) << "A selection request has arrived!\n";
+	LOG(LOG_DEBUG) << hex << "Owner = 0x" << owner << endl;
+	LOG(LOG_DEBUG) << "Selection atom = " << GetAtomName(disp, selection) << endl;
+	LOG(LOG_DEBUG) << "Target atom    = " << GetAtomName(disp, target)    << endl;
+	LOG(LOG_DEBUG) << "Property atom  = " << GetAtomName(disp, property) << endl;
+	LOG(LOG_DEBUG) << hex << "Requestor = 0x" << requestor << dec << endl;
+	LOG(LOG_DEBUG) << "Timestamp = " << timestamp << endl;
+
+
+	//X should only send requests for the selections since we own.
+	//since we own exaclty one, we don't need to check it.
+
+	//Replies to the application requesting a pasting are XEvenst
+	//sent via XSendEvent
+	XEvent s;
+
+	//Start by constructing a refusal request.
+	s.xselection.type      = SelectionNotify;
+	//s.xselection.serial     - filled in by server
+	//s.xselection.send_event - filled in by server
+	//s.xselection.display    - filled in by server
+	s.xselection.requestor = requestor;
+	s.xselection.selection = selection;
+	s.xselection.target    = target;
+	s.xselection.property  = None;   //This means refusal
+	s.xselection.time      = timestamp;
+
+
+
+	if(target == XA_multiple)
+	{
+		//In this case, the property has been filled up with a list
+		//of atom pairs. The pairs being (target, property). The
+		//processing should continue as if whole bunch of
+		//SelectionRequest events had been received with the
+		//targets and properties specified. Only one SelectionNotify
+		//is sent, once all of the conversions have been done, so the
+		//requestor gets everything it asked for in a single round trip.
+		if(property != None && convert_multiple(disp, requestor, property, typed_data, transfers, shared, offers))
+			s.xselection.property = property;
+		else
+			LOG(LOG_ERROR) << "Malformed MULTIPLE request. Replying with refusal.\n";
+	}
+	else if(convert_target(disp, requestor, target, property, typed_data, transfers, shared, offers))
+		s.xselection.property = property;
+	else
+	{
+		//We've been asked to convert to something we don't know
+		//about.
+		LOG(LOG_DEBUG) << "No valid conversion. Replying with refusal.\n";
+	}
+
+	//Reply
+	XSendEvent(disp, e.xselectionrequest.requestor, True, 0, &s);
+	LOG(LOG_DEBUG) << endl;
+}
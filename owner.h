@@ -0,0 +1,150 @@
+#ifndef X_CLIPBOARD_OWNER_H
+#define X_CLIPBOARD_OWNER_H
+
+#include <X11/Xlib.h>
+#include <map>
+#include <list>
+#include <vector>
+#include "convert.h"
+#include "shared.h"
+
+struct z_stream_s;
+
+//Data which is too large to fit in to a single request has to be sent
+//incrementally using the INCR mechanism from the ICCCM (section 2.7.2).
+//Instead of the data, the property is set to a single integer of type
+//INCR. The requestor then deletes the property, and every time it does so
+//we receive a PropertyNotify event and write the next chunk. A zero length
+//chunk signals the end of the data. This struct records how far through
+//a transfer we are. Transfers are keyed by (requestor, property), since
+//that uniquely identifies the property being deleted.
+//
+//Many transfers to different requestors can be in progress at once. Rather
+//than writing a chunk as soon as a property is deleted, the transfer is
+//marked as ready, and once all the queued events have been dealt with, every
+//ready transfer gets one chunk. That way, one requestor with a lot of data
+//to read can't hold up everyone else. Requestors which stop reading (or
+//crash) have their transfers abandoned.
+//
+//Large data which is asked for compressed is compressed a chunk at a time as
+//it is sent, rather than all at once before the transfer can start. Then
+//payload is the uncompressed data, and offset is how much of it has been
+//compressed.
+struct IncrTransfer
+{
+	Atom target;
+	Payload* payload;
+	size_t offset;
+	z_stream_s* deflater;   //0 unless compressing as the data is sent
+	bool ready;             //The requestor has deleted the property
+	double last_active;     //On the metric_now clock
+	double chunk_sent;      //When the last chunk was written, or 0
+	size_t chunk_size;
+};
+
+typedef std::map<std::pair<Window, Atom>, IncrTransfer> IncrTransfers;
+
+
+//A request which needs targets that are still being converted in the
+//background (see ConversionEngine::prepare). It is answered once they are
+//ready, or refused if they take longer than the transfer timeout.
+struct DeferredRequest
+{
+	XEvent request;
+	std::vector<Atom> needs;
+	double since;           //On the metric_now clock
+};
+
+
+//Private targets which an owner can offer as well as the data itself.
+enum
+{
+	OFFER_SHARED = 1,       //_X_CLIPBOARD_SHM (see shared.h)
+	OFFER_COMPRESSED = 2    //_X_CLIPBOARD_ZLIB, any target compressed with zlib
+};
+
+
+//Construct a list of targets and place them in the specified property. This
+//is what a requestor gets when it asks for TARGETS, and what a drag source
+//puts in XdndTypeList. offers says which private targets to add.
+void set_targets_property(Display* disp, Window w, ConversionEngine& typed_data, Atom property, int offers = 0);
+
+
+//The owner of a selection. It answers requests for the data in typed_data,
+//including TARGETS, MULTIPLE and INCR transfers.
+//
+//The owner never waits for events itself: whoever runs the event loop hands
+//every event to handle_event, and calls run once the queue is empty (and
+//every so often when there are no events), which is when INCR chunks are
+//sent. This means that an owner can share a connection (and a thread) with
+//anything else. If typed_data converts in the background, run also answers
+//requests whose conversions have finished, so it must be called when the
+//loop's watchers have been.
+class SelectionOwner
+{
+	public:
+		SelectionOwner(Display* disp, Window w, ConversionEngine& typed_data);
+
+		//Take ownership of a selection. Only one selection is held at
+		//once, so any other one is given up. Returns false if the
+		//ownership could not be taken.
+		bool own(Atom selection, Time t);
+
+		//Deal with SelectionRequest and SelectionClear events, and with the
+		//PropertyNotify and DestroyNotify events which drive INCR
+		//transfers. Other events are ignored.
+		void handle_event(const XEvent& e);
+
+		//Answer requests whose conversions have finished, send the next
+		//chunk to every INCR transfer which is ready for one, abandon
+		//transfers which have stalled and release file mappings which
+		//nobody is using.
+		void run();
+
+		//When run next needs to be called, even if no events arrive, on
+		//the metric_now clock: the next time a stalled transfer would
+		//time out (or a deferred request be refused), or the next check
+		//for idle file mappings.
+		double deadline() const;
+
+		//Abandon INCR transfers where the requestor hasn't asked for the
+		//next chunk for this many milliseconds (0 for never), and refuse
+		//requests which have waited this long for a conversion. The
+		//default is 10 seconds.
+		void set_transfer_timeout(int ms) { transfer_timeout = ms; }
+
+		//Offer _X_CLIPBOARD_SHM, so that requestors on the same machine
+		//can get the data through shared memory. See shared.h.
+		void offer_shared_memory(bool offer) { offers = offer ? offers | OFFER_SHARED : offers & ~OFFER_SHARED; }
+
+		//Offer _X_CLIPBOARD_ZLIB, so that requestors on slow connections
+		//can have any target compressed. The requestor gives the target
+		//as a parameter, as with _X_CLIPBOARD_SHM.
+		void offer_compression(bool offer) { offers = offer ? offers | OFFER_COMPRESSED : offers & ~OFFER_COMPRESSED; }
+
+		//True once a SelectionClear has arrived.
+		bool lost() const { return lost_selection; }
+
+		//True while INCR transfers are in progress, or requests are
+		//waiting for conversions. They are allowed to finish after the
+		//selection is lost.
+		bool busy() const { return !transfers.empty() || !deferred.empty(); }
+
+	private:
+		void process_selection_request(const XEvent& e);
+		bool prepared(const std::vector<Atom>& targets);
+		void answer_deferred();
+
+		Display* disp;
+		Window w;
+		ConversionEngine& typed_data;
+		Atom selection;
+		bool lost_selection;
+		IncrTransfers transfers;
+		int transfer_timeout;
+		int offers;
+		SharedPayloads shared;
+		std::list<DeferredRequest> deferred;
+};
+
+#endif
@@ -1,10 +1,14 @@
 #include <X11/Xlib.h>
 #include <X11/Xatom.h>
-#include <map>
+#include <X11/extensions/Xfixes.h>
 #include <iostream>
+#include <fstream>
+#include <vector>
+#include <cstdlib>
 #include <cstdio>
-#include <climits>
-#include <cstring>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "xclipboard.h"
 using namespace std;
 
 /*
@@ -89,6 +93,21 @@ via XSendEvent() to tell you that the data is ready to be read. Now you have
 successfully pasted some data.
 
 
+Large transfers with INCR
+-------------------------
+
+There is a limit on the size of a request sent to the X server, so a property
+can not be filled with arbitrarily large amounts of data in one go. Instead,
+the owner can set the property to a single integer of type INCR (a lower bound
+on the size of the data) and send the SelectionNotify as normal. The requestor
+then deletes the property, which tells the owner to write the first chunk
+of data in to it. Every time the requestor has read a chunk, it deletes the
+property to ask for the next one. The end of the data is marked with a zero
+length chunk. Since this is all driven by PropertyNotify events, the
+requestor must select PropertyChangeMask on its window before it deletes the
+INCR property.
+
+
 Drag 'n Drop with XDND
 ----------------------
 
@@ -132,142 +151,136 @@ the XdndSelection clipboard.
 [1] XDnD also provides the first three targets in the first message it sends.
 If it offers three or fewer targets, it may not provide XdndTypeList.
 
-And here's how specifically:
+The requesting side is in requester.cc (SelectionRequester) and the
+receiving end of XDnD is in dnd.cc (DndTarget). This program runs the event
+loop and writes out the data.
 */
 
 
 
-//Convert an atom name in to a std::string
-string GetAtomName(Display* disp, Atom a)
+//Dump the binary data
+void write_data(const SelectionRequester& paste)
 {
-	if(a == None)
-		return "None";
-	else
-		return XGetAtomName(disp, a);
+	LOG(LOG_DEBUG) << "Data begins:" << endl;
+	LOG(LOG_DEBUG) << "--------\n";
+	vector<unsigned char> buf;
+	cout.write((char*)wire_data(paste.data(), buf), paste.size());
+	cout << flush;
+	LOG(LOG_DEBUG) << endl << "--------" << endl << "Data ends\n";
+	LOG(LOG_INFO) << "Pasted " << paste.size() << " bytes using " << total_round_trips << " round trips.\n";
 }
 
-struct Property
-{
-	unsigned char *data;
-	int format;
-	unsigned long nitems;
-	Atom type;
-};
 
-
-//This atom isn't provided by default
-Atom XA_TARGETS;
+//The exit code for a paste which failed.
+//If the selection can not be converted, quit with error 2.
+//If TARGETS can not be converted (nothing owns the selection)
+//then quit with code 3. If nothing suitable is offered, quit with 1, if
+//the data could not be streamed out, quit with 7, and if the owner took too
+//long, quit with 8.
+int exit_code(SelectionRequester::State state)
+{
+	if(state == SelectionRequester::NO_MATCH)
+		return 1;
+	else if(state == SelectionRequester::NO_OWNER)
+		return 3;
+	else if(state == SelectionRequester::WRITE_ERROR)
+		return 7;
+	else if(state == SelectionRequester::TIMED_OUT)
+		return 8;
+	else
+		return 2;
+}
 
 
-//This fetches all the data from a property
-Property read_property(Display* disp, Window w, Atom property)
+//Notices when whatever is reading our output goes away (the other end of
+//a pipe is closed), so that we can stop, rather than carrying on waiting
+//for data which nobody wants.
+class OutputWatcher: public FdWatcher
 {
-	Atom actual_type;
-	int actual_format;
-	unsigned long nitems;
-	unsigned long bytes_after;
-	unsigned char *ret = 0;
+	public:
+		OutputWatcher()
+		:closed(0)
+		{}
 
-	int read_bytes = 1024;
+		void fd_ready(int, short revents)
+		{
+			if(revents & (POLLERR | POLLHUP))
+				closed = 1;
+		}
+
+		bool closed;
+};
 
-	//Keep trying to read the property until there are no
-	//bytes unread.
-	do
-	{
-		if(ret != 0)
-			XFree(ret);
-		XGetWindowProperty(disp, w, property, 0, read_bytes, False, AnyPropertyType,
-							&actual_type, &actual_format, &nitems, &bytes_after,
-							&ret);
 
-		read_bytes *= 2;
-	}while(bytes_after != 0);
+//Wait for the next event, and put it in e. Returns false if the deadline
+//passed (or something else needs looking at) first.
+bool next_event(Display* disp, EventLoop& loop, double deadline, XEvent& e)
+{
+	bool have_event = loop.wait(deadline);
 
-	cerr << endl;
-	cerr << "Actual type: " << GetAtomName(disp, actual_type) << endl;
-	cerr << "Actual format: " << actual_format << endl;
-	cerr << "Number of items: " << nitems <<  endl;
+	//SIGUSR1 interrupts the wait, so it's noticed straight away.
+	dump_metrics_if_requested();
 
-	Property p = {ret, actual_format, nitems, actual_type};
+	if(have_event)
+		XNextEvent(disp, &e);
 
-	return p;
+	return have_event;
 }
 
 
-// This function takes a list of targets which can be converted to (atom_list, nitems)
-// and a list of acceptable targets with prioritees (datatypes). It returns the highest
-// entry in datatypes which is also in atom_list: ie it finds the best match.
-Atom pick_target_from_list(Display* disp, Atom* atom_list, int nitems, map<string, int> datatypes)
+//Fetch several targets at once, and write each one to its file. Returns 0 if
+//everything was fetched, 2 if anything was refused, timed out or could not be
+//written, 3 if nothing owns the selection, or 8 if TARGETS timed out.
+int batch_paste(Display* disp, Window w, Atom sel, const vector<Atom>& targets, const vector<string>& files, const PasteTimeouts& timeouts)
 {
-	Atom to_be_requested = None;
-	//This is higger than the maximum priority.
-	int priority = INT_MAX;
+	XEvent e;
+	EventLoop loop(disp);
+	BatchRequester fetch(disp, w, sel);
+	fetch.set_timeouts(timeouts);
+	fetch.fetch(sel, targets, CurrentTime);
 
-	for(int i = 0; i < nitems; i++)
+	for(;;)
 	{
-		string atom_name = GetAtomName(disp, atom_list[i]);
-		cerr << "Type " << i << " = " << atom_name << endl;
-
-		//See if this data type is allowed and of higher priority (closer to zero)
-		//than the present one.
-		if(datatypes.find(atom_name)!= datatypes.end())
-			if(priority > datatypes[atom_name])
-			{
-				cerr << "Will request type: " << atom_name << endl;
-				priority = datatypes[atom_name];
-				to_be_requested = atom_list[i];
-			}
+		if(next_event(disp, loop, fetch.deadline(), e) ? fetch.handle_event(e) : fetch.check_deadline(metric_now()))
+			break;
 	}
 
-	return to_be_requested;
-}
+	if(fetch.state() != SelectionRequester::DONE)
+		return exit_code(fetch.state());
 
-// Finds the best target given up to three atoms provided (any can be None).
-// Useful for part of the Xdnd protocol.
-Atom pick_target_from_atoms(Display* disp, Atom t1, Atom t2, Atom t3, map<string, int> datatypes)
-{
-	Atom atoms[3];
-	int  n = 0;
-
-	if(t1 != None)
-		atoms[n++] = t1;
-
-	if(t2 != None)
-		atoms[n++] = t2;
-
-	if(t3 != None)
-		atoms[n++] = t3;
+	int ret = 0;
+	unsigned long total = 0;
 
-	return pick_target_from_list(disp, atoms, n, datatypes);
-}
+	for(unsigned int i = 0; i < targets.size(); i++)
+	{
+		const SelectionRequester* r = fetch.result(targets[i]);
 
+		if(r->state() != SelectionRequester::DONE)
+		{
+			LOG(LOG_ERROR) << "Could not fetch " << GetAtomName(disp, targets[i]) << endl;
+			ret = 2;
+			continue;
+		}
 
-// Finds the best target given a local copy of a property.
-Atom pick_target_from_targets(Display* disp, Property p, map<string, int> datatypes)
-{
-	//The list of targets is a list of atoms, so it should have type XA_ATOM
-	//but it may have the type TARGETS instead.
+		vector<unsigned char> buf;
+		ofstream out(files[i].c_str(), ios::binary);
+		out.write((char*)wire_data(r->data(), buf), r->size());
 
-	if((p.type != XA_ATOM && p.type != XA_TARGETS) || p.format != 32)
-	{
-		//This would be really broken. Targets have to be an atom list
-		//and applications should support this. Nevertheless, some
-		//seem broken (MATLAB 7, for instance), so ask for STRING
-		//next instead as the lowest common denominator
+		if(!out)
+		{
+			LOG(LOG_ERROR) << "Could not write " << files[i] << endl;
+			ret = 2;
+			continue;
+		}
 
-		if(datatypes.count("STRING"))
-			return XA_STRING;
-		else
-			return None;
+		LOG(LOG_INFO) << "Wrote " << r->size() << " bytes of " << GetAtomName(disp, targets[i]) << " to " << files[i] << endl;
+		total += r->size();
 	}
-	else
-	{
-		Atom *atom_list = (Atom*)p.data;
 
-		return pick_target_from_list(disp, atom_list, p.nitems, datatypes);
-	}
-}
+	LOG(LOG_INFO) << "Pasted " << total << " bytes using " << total_round_trips << " round trips.\n";
 
+	return ret;
+}
 
 
 int main(int argc, char ** argv)
@@ -278,60 +291,158 @@ int main(int argc, char ** argv)
 	int screen;
 	XEvent e;
 
+	init_log_level();
+
 	//The usual Xinit stuff...
 	disp = XOpenDisplay(NULL);
 	screen = DefaultScreen(disp);
 	root = RootWindow(disp, screen);
 
 	int do_xdnd = 0;
+	bool watch = 0;
+	bool batch = 0;
+	bool stream = 0;
+	bool speculate = 0;
+	bool shm = 0;
+	bool compress = 0;
+
+	//By default, give the owner 5 seconds to say what's on offer, and 10
+	//for everything else, which matches how long selection waits for an
+	//INCR requestor.
+	PasteTimeouts timeouts = {5000, 10000, 10000};
 
 	//Process commandline args
 
+	//Options come before everything else. With -watch, rather than pasting
+	//once, paste watches the selection and pastes every time it changes.
+	//-batch fetches several types in one go, each in to its own file.
+	//-stream writes the data out as it arrives. -speculate asks for the
+	//most preferred type at the same time as TARGETS. -timeout sets how
+	//long to wait for the owner. -shm gets the data through shared memory
+	//if the owner is on the same machine and offers it. -compress gets it
+	//compressed if the owner offers that, which helps over slow links.
+	int first_arg = 1;
+	for(; first_arg < argc; first_arg++)
+	{
+		if(argv[first_arg] == string("-timeout") && first_arg + 1 < argc)
+		{
+			if(!parse_timeouts(argv[++first_arg], timeouts))
+			{
+				LOG(LOG_ERROR) << "Expected -timeout targets[,convert[,incr_chunk]] in milliseconds.\n";
+				return 6;
+			}
+			continue;
+		}
+
+		if(argv[first_arg] == string("-watch"))
+			watch = 1;
+		else if(argv[first_arg] == string("-batch"))
+			batch = 1;
+		else if(argv[first_arg] == string("-stream"))
+			stream = 1;
+		else if(argv[first_arg] == string("-speculate"))
+			speculate = 1;
+		else if(argv[first_arg] == string("-shm"))
+			shm = 1;
+		else if(argv[first_arg] == string("-compress"))
+			compress = 1;
+		else
+			break;
+	}
+
+	//-batch writes to files with its own requests, so the options which
+	//change how a single paste is fetched or written don't apply to it.
+	if(batch && (watch || stream || speculate || shm || compress))
+	{
+		LOG(LOG_ERROR) << "-batch can't be combined with -watch, -stream, -speculate, -shm or -compress.\n";
+		return 6;
+	}
+
 	//This is the kind of data we're prepared to select
-	//Each argument corresponds to a type, in order of preference
-	//The key is the type the data is the priority (bigger int is lower)
-	map<string, int> datatypes;
+	//Each argument corresponds to a type (or a pattern, eg image/*), in
+	//order of preference. See preferences.h.
+	TargetPreferences preferences;
 
 	//The first command line argument selects the buffer.
 	//by default we use PRIMARY, the only other option
 	//which is normally sensible is CLIPBOARD
-	Atom sel = XInternAtom(disp, "PRIMARY", 0);
+	Atom sel = XA_PRIMARY;
 
-	if(argc > 1)
+	if(argc > first_arg)
 	{
-		if(argv[1] == string("-dnd"))
+		if(argv[first_arg] == string("-dnd") && !watch && !batch)
 			do_xdnd = 1;
-		else if(argv[1] == string("-dndroot"))
+		else if(argv[first_arg] == string("-dndroot") && !watch && !batch)
 			do_xdnd = 2;
 		else
-			sel = XInternAtom(disp, argv[1], 0);
+			register_atom(argv[first_arg], &sel);
 	}
 
-	for(int i = 2; i < argc; i++)
+	//In batch mode, each argument is type=file.
+	vector<string> batch_types, batch_files;
+
+	for(int i = first_arg + 1; i < argc; i++)
 	{
-		datatypes[argv[i]] = i;
+		string arg = argv[i];
+
+		if(batch && arg.find('=') != string::npos)
+		{
+			batch_types.push_back(arg.substr(0, arg.find('=')));
+			batch_files.push_back(arg.substr(arg.find('=') + 1));
+		}
+		else if(batch)
+		{
+			LOG(LOG_ERROR) << "Expected type=file, not " << arg << endl;
+			return 6;
+		}
+		else
+			preferences.add(argv[i]);
 	}
 
+	//The atoms for the batch types are interned along with everything else.
+	//The names must not move until then.
+	vector<Atom> batch_targets(batch_types.size());
+	for(unsigned int i = 0; i < batch_types.size(); i++)
+		register_atom(batch_types[i].c_str(), &batch_targets[i]);
+
 	//The default if there is no command line argument
-	if(datatypes.empty())
-		datatypes["STRING"] = 1;
+	if(preferences.empty())
+		preferences.add("STRING");
+
+	//The types are interned along with everything else.
+	preferences.register_atoms();
 
 
 	//We need a target window for the pasted data to be sent to.
 	//However, this does not need to be mapped.
 	w = XCreateSimpleWindow(disp, root, 0, 0, 100, 100, 0, BlackPixel(disp, screen), BlackPixel(disp, screen));
 
-	//Atoms for Xdnd
-	Atom XdndEnter = XInternAtom(disp, "XdndEnter", False);
-	Atom XdndPosition = XInternAtom(disp, "XdndPosition", False);
-	Atom XdndStatus = XInternAtom(disp, "XdndStatus", False);
-	Atom XdndTypeList = XInternAtom(disp, "XdndTypeList", False);
-	Atom XdndActionCopy = XInternAtom(disp, "XdndActionCopy", False);
-	Atom XdndDrop = XInternAtom(disp, "XdndDrop", False);
-	Atom XdndLeave = XInternAtom(disp, "XdndLeave", False);
-	Atom XdndFinished = XInternAtom(disp, "XdndFinished", False);
-	Atom XdndSelection = XInternAtom(disp, "XdndSelection", False);
-	Atom XdndProxy = XInternAtom(disp, "XdndProxy", False);
+	//INCR transfers are driven by property changes on our window, so
+	//listen for them before any data can arrive.
+	XSelectInput(disp, w, PropertyChangeMask);
+
+	//Get all the atoms we need (including those for Xdnd) in one go.
+	intern_atoms(disp);
+	total_round_trips++;
+
+	//Timings are dumped on SIGUSR1, and at exit if X_CLIPBOARD_METRICS is set.
+	init_metrics(disp, "paste");
+
+	//When speculating, the guess is the most preferred type (if it's not
+	//a pattern).
+	Atom guess = speculate ? preferences.first() : None;
+
+	if(batch)
+		return batch_paste(disp, w, sel, batch_targets, batch_files, timeouts);
+
+	//Everything waits for X events, deadlines and the output going away
+	//all at once. Only pipes and sockets can go away.
+	EventLoop loop(disp);
+	OutputWatcher output;
+	struct stat out_stat;
+
+	if(fstat(STDOUT_FILENO, &out_stat) == 0 && (S_ISFIFO(out_stat.st_mode) || S_ISSOCK(out_stat.st_mode)))
+		loop.watch(STDOUT_FILENO, 0, &output);
 
 
 	if(do_xdnd)
@@ -342,254 +453,141 @@ int main(int argc, char ** argv)
 			XMapWindow(disp, w);
 			drop_window = w;
 		}
-		else if(do_xdnd == 2)
+		else
 		{
-			//Set up the root window
-			XGrabServer(disp);
-			//Check for the existence of XdndProxy
-			Property p = read_property(disp, root, XdndProxy);
-
-			if(p.type == None)
-			{
-				//Property does not exist, so set it to redirect to me
-				XChangeProperty(disp, root, XdndProxy, XA_WINDOW, 32, PropModeReplace, (unsigned char*)&w, 1);
-				//Set the proxy on me to point to me (as per the spec)
-				XChangeProperty(disp, w, XdndProxy, XA_WINDOW, 32, PropModeReplace, (unsigned char*)&w, 1);
-			}
-			else
-			{
-				if(p.type == XA_WINDOW && p.format == 32 && p.nitems == 1)
-					cerr << "Root already proxied to 0x" << hex << *(unsigned int*)p.data << endl;
-				else
-					cerr << "Root already proxied to <malformed>\n";
-
+			if(!proxy_root(disp, root, w))
 				return 4;
-			}
 
-			XUngrabServer(disp);
 			drop_window = root;
 		}
 
-		//Announce XDND support
-		Atom XdndAware = XInternAtom(disp, "XdndAware", False);
-		Atom version = 5;
-		XChangeProperty(disp, w, XdndAware, XA_ATOM, 32, PropModeReplace, (unsigned char*)&version, 1);
-	}
+		DndTarget target(disp, w, drop_window, sel, preferences);
+		target.set_timeouts(timeouts);
 
+		for(;;)
+		{
+			bool finished = next_event(disp, loop, target.deadline(), e) ? target.handle_event(e) : target.check_deadline(metric_now());
 
-	//This is a meta-format for data to be "pasted" in to.
-	//Requesting this format acquires a list of possible
-	//formats from the application which copied the data.
-	XA_TARGETS = XInternAtom(disp, "TARGETS", False);
+			if(output.closed)
+			{
+				LOG(LOG_ERROR) << "The output has been closed.\n";
+				return 7;
+			}
 
+			if(finished)
+			{
+				const SelectionRequester& paste = target.requester();
 
+				if(paste.state() == SelectionRequester::DONE)
+					write_data(paste);
 
+				target.finish();
 
-	if(!do_xdnd)
-	{
-		//Request a list of possible conversions, if we're pasting.
-		XConvertSelection(disp, sel, XA_TARGETS, sel, w, CurrentTime);
+				//Un-proxy the root window
+				if(do_xdnd == 2)
+					unproxy_root(disp, root);
+
+				XSync(disp, False);
+
+				return paste.state() == SelectionRequester::DONE ? 0 : exit_code(paste.state());
+			}
+		}
 	}
 
 
-	XFlush(disp);
+	//In watch mode, XFixes tells us whenever the selection changes owner,
+	//which happens every time something new is copied. This is much cheaper
+	//than repeatedly pasting to see if anything has changed.
+	int xfixes_event_base = 0, xfixes_error_base;
+	if(watch)
+	{
+		total_round_trips++;
+		if(!XFixesQueryExtension(disp, &xfixes_event_base, &xfixes_error_base))
+		{
+			LOG(LOG_ERROR) << "The XFIXES extension is needed for -watch.\n";
+			return 5;
+		}
+
+		XFixesSelectSelectionInput(disp, w, sel, XFixesSetSelectionOwnerNotifyMask);
+	}
+
+	//Request a list of possible conversions, and then the best one (or
+	//the guess, along with the list). When watching, this fetches the
+	//current contents.
+	SpeculativeRequester paste(disp, w, sel);
+	paste.set_timeouts(timeouts);
+	paste.use_shared_memory(shm);
+	paste.use_compression(compress);
 
+	//Records need the length up front, so they can't be streamed.
+	if(stream && !watch)
+		paste.stream_to(STDOUT_FILENO);
 
-	Atom to_be_requested = None;
-	bool sent_request = 0;
-	int xdnd_version = 0;
-	Window xdnd_source_window = None;
+	paste.paste(sel, preferences, guess, CurrentTime);
 
 	for(;;)
 	{
-		XNextEvent(disp, &e);
+		bool finished;
 
-		if(e.type == ClientMessage)
+		//Wait for no longer than the current phase of the paste is
+		//allowed to take.
+		if(!next_event(disp, loop, paste.deadline(), e))
+			finished = paste.check_deadline(metric_now());
+		else
 		{
-			cerr << "A ClientMessage has arrived:\n";
-			cerr << "Type = " << GetAtomName(disp, e.xclient.message_type) << " (" << e.xclient.format << ")\n";
-
-
-			if(e.xclient.message_type == XdndEnter)
+			if(watch && e.type == xfixes_event_base + XFixesSelectionNotify)
 			{
-				bool more_than_3 = e.xclient.data.l[1] & 1;
-				Window source = e.xclient.data.l[0];
-
-				cerr << hex << "Source window = 0x" << source << dec << endl;
-				cerr << "Supports > 3 types = " << (more_than_3) << endl;
-				cerr << "Protocol version = " << ( e.xclient.data.l[1] >> 24) << endl;
-				cerr << "Type 1 = " << GetAtomName(disp, e.xclient.data.l[2]) << endl;
-				cerr << "Type 2 = " << GetAtomName(disp, e.xclient.data.l[3]) << endl;
-				cerr << "Type 3 = " << GetAtomName(disp, e.xclient.data.l[4]) << endl;
-
-				xdnd_version = ( e.xclient.data.l[1] >> 24);
-
-				//Query which conversions are available and pick the best
-
-				if(more_than_3)
-				{
-					//Fetch the list of possible conversions
-					//Notice the similarity to TARGETS with paste.
-					Property p = read_property(disp, source , XdndTypeList);
-					to_be_requested = pick_target_from_targets(disp, p, datatypes);
-					XFree(p.data);
-				}
-				else
-				{
-					//Use the available list
-					to_be_requested = pick_target_from_atoms(disp, e.xclient.data.l[2], e.xclient.data.l[3], e.xclient.data.l[4], datatypes);
-				}
+				XFixesSelectionNotifyEvent* n = (XFixesSelectionNotifyEvent*)&e;
 
+				LOG(LOG_INFO) << "The selection has a new owner: 0x" << hex << n->owner << dec << endl << endl;
 
-				cerr << "Requested type = " << GetAtomName(disp, to_be_requested) << endl;
-			}
-			else if(e.xclient.message_type == XdndPosition)
-			{
-				cerr << hex << "Source window = 0x" << e.xclient.data.l[0] << dec << endl;
-				cerr << "Position: x=" << (e.xclient.data.l[2]  >> 16) << " y=" << (e.xclient.data.l[2] &0xffff)  << endl;
-				cerr << "Timestamp = " << e.xclient.data.l[3] << " (Version >= 1 only)\n";
-
-				Atom action = XdndActionCopy;
-				if(xdnd_version >= 2)
-					action = e.xclient.data.l[4];
-
-				cerr << "Action = " << GetAtomName(disp, action) << " (Version >= 2 only)\n";
-
-
-				//Xdnd: reply with an XDND status message
-				XClientMessageEvent m;
-				memset(&m, 0, sizeof(m));
-				m.type = ClientMessage;
-				m.display = e.xclient.display;
-				m.window = e.xclient.data.l[0];
-				m.message_type = XdndStatus;
-				m.format = 32;
-				m.data.l[0] = drop_window;
-				m.data.l[1] = (to_be_requested != None);
-				m.data.l[2] = 0; //Specify an empty rectangle
-				m.data.l[3] = 0;
-				m.data.l[4] = XdndActionCopy; //We only accept copying anyway.
-
-				XSendEvent(disp, e.xclient.data.l[0], False, NoEventMask, (XEvent*)&m);
-				XFlush(disp);
-			}
-			else if(e.xclient.message_type == XdndLeave)
-			{
-				//to_be_requested = None;
-
-				//We can't actually reset to_be_requested, since OOffice always
-				//sends this event, even when it doesn't mean to.
-				cerr << "Xdnd cancelled.\n";
-			}
-			else if(e.xclient.message_type == XdndDrop)
-			{
-				if(to_be_requested == None)
-				{
-					//It's sending anyway, despite instructions to the contrary.
-					//So reply that we're not interested.
-					XClientMessageEvent m;
-					memset(&m, 0, sizeof(m));
-					m.type = ClientMessage;
-					m.display = e.xclient.display;
-					m.window = e.xclient.data.l[0];
-					m.message_type = XdndFinished;
-					m.format = 32;
-					m.data.l[0] = drop_window;
-					m.data.l[1] = 0;
-					m.data.l[2] = None; //Failed.
-					XSendEvent(disp, e.xclient.data.l[0], False, NoEventMask, (XEvent*)&m);
-				}
+				//Start again from the beginning, and abandon any transfer
+				//in progress, since the data is out of date.
+				if(n->owner != None)
+					paste.paste(sel, preferences, guess, n->selection_timestamp);
 				else
-				{
-					xdnd_source_window = e.xclient.data.l[0];
-					if(xdnd_version >= 1)
-						XConvertSelection(disp, XdndSelection, to_be_requested, sel, w, e.xclient.data.l[2]);
-					else
-						XConvertSelection(disp, XdndSelection, to_be_requested, sel, w, CurrentTime);
-				}
+					paste.cancel();
 			}
 
-			cerr << endl;
+			finished = paste.handle_event(e);
 		}
 
-		if(e.type == SelectionNotify)
+		if(output.closed)
 		{
-			Atom target = e.xselection.target;
+			LOG(LOG_ERROR) << "The output has been closed.\n";
+			return 7;
+		}
 
-			cerr << "A selection notify has arrived!\n";
-			cerr << hex << "Requestor = 0x" << e.xselectionrequest.requestor << dec << endl;
-			cerr << "Selection atom = " << GetAtomName(disp, e.xselection.selection) << endl;
-			cerr << "Target atom    = " << GetAtomName(disp, target)    << endl;
-			cerr << "Property atom  = " << GetAtomName(disp, e.xselection.property) << endl;
+		if(!finished)
+			continue;
 
-			if(e.xselection.property == None)
-			{
-				//If the selection can not be converted, quit with error 2.
-				//If TARGETS can not be converted (nothing owns the selection)
-				//then quit with code 3.
-				return 2 + (target == XA_TARGETS);
-			}
-			else
-			{
-				Property prop = read_property(disp, w, sel);
-
-				//If we're being given a list of targets (possible conversions)
-				if(target == XA_TARGETS && !sent_request)
-				{
-					sent_request = 1;
-					to_be_requested = pick_target_from_targets(disp, prop, datatypes);
-
-					if(to_be_requested == None)
-					{
-						cerr << "No matching datatypes.\n";
-						return 1;
-					}
-					else //Request the data type we are able to select
-					{
-						cerr << "Now requesting type " << GetAtomName(disp, to_be_requested) << endl;
-						XConvertSelection(disp, sel, to_be_requested, sel, w, CurrentTime);
-					}
-				}
-				else if(target == to_be_requested)
-				{
-					//Dump the binary data
-					cerr << "Data begins:" << endl;
-					cerr << "--------\n";
-					cout.write((char*)prop.data, prop.nitems * prop.format/8);
-					cout << flush;
-					cerr << endl << "--------" << endl << "Data ends\n";
-
-					if(do_xdnd)
-					{
-						//Reply OK.
-						XClientMessageEvent m;
-						memset(&m, 0, sizeof(m));
-						m.type = ClientMessage;
-						m.display = disp;
-						m.window = xdnd_source_window;
-						m.message_type = XdndFinished;
-						m.format = 32;
-						m.data.l[0] = w;
-						m.data.l[1] = 1;
-						m.data.l[2] = XdndActionCopy; //We only ever copy.
-
-						//Reply that all is well.
-						XSendEvent(disp, xdnd_source_window, False, NoEventMask, (XEvent*)&m);
-
-						//Un-proxy the root window
-						if(do_xdnd == 2)
-							XDeleteProperty(disp, root, XdndProxy);
-
-						XSync(disp, False);
-					}
-
-					return 0;
-				}
-				else return 0;
-
-				XFree(prop.data);
-			}
-			cerr << endl;
+		if(paste.state() != SelectionRequester::DONE)
+		{
+			//In watch mode, there's nothing to paste this time, so wait for
+			//the next change.
+			if(!watch)
+				return exit_code(paste.state());
+		}
+		else if(watch)
+		{
+			//Each paste is written as a record: a header line giving
+			//the length and type, followed by exactly that many bytes.
+			const SelectionRequester& r = paste.result();
+			vector<unsigned char> buf;
+			cout << r.size() << " " << GetAtomName(disp, r.target()) << "\n";
+			cout.write((char*)wire_data(r.data(), buf), r.size());
+			cout << flush;
+			LOG(LOG_INFO) << "Wrote record of " << r.size() << " bytes.\n\n";
+		}
+		else if(stream)
+		{
+			LOG(LOG_INFO) << "Streamed " << paste.result().size() << " bytes using " << total_round_trips << " round trips.\n";
+			return 0;
+		}
+		else
+		{
+			write_data(paste.result());
+			return 0;
 		}
 	}
 }
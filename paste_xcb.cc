@@ -0,0 +1,427 @@
+#include <xcb/xcb.h>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <cstdio>
+#include <ctime>
+#include <unistd.h>
+#include <poll.h>
+#include "log.h"
+#include "util.h"
+using namespace std;
+
+//This is paste (see paste.cc for how pasting works), written with XCB
+//instead of Xlib, so that the two can be compared head to head (eg with
+//'BENCH_PASTE=./paste-xcb make bench'). It's a standalone program for
+//measuring, not an XCB backend for the library, so it only does ordinary
+//pastes of exact types, with -stream and -timeout. It doesn't do patterns,
+//-shm, -compress, -batch, -speculate, -watch or XDnD, and says so rather
+//than taking those options as the name of the selection.
+//As with paste, nothing waits forever for an owner which has hung: each
+//phase (TARGETS, the conversion and each INCR chunk) has a deadline, and
+//giving up exits with code 8.
+//
+//Xlib sends a request and waits for the reply before doing anything else,
+//so every request with a reply is a round trip. XCB sends a request and gives
+//back a cookie, and the reply is only waited for when it's needed. So
+//requests which don't depend on each other are sent together, and their
+//replies collected together, costing a single round trip:
+//
+// * All of the atoms are interned at once, along with the query for the
+//   maximum request size.
+// * The preferred types are interned as well (if they exist), so picking a
+//   target from TARGETS compares numbers, and needs no atom names at all.
+// * A property is read with a single request for as much as a request can
+//   hold. If there's more, all of the remaining windows are asked for
+//   together, since their offsets are known from the first reply.
+// * Properties are deleted as they are read (by GetProperty itself), rather
+//   than with a separate request. For INCR, that's what asks for the next
+//   chunk.
+
+
+//The number of times we had to wait for the server or the owner.
+unsigned long round_trips = 0;
+
+
+//The current time in milliseconds, from a clock which never goes backwards.
+double now_ms()
+{
+	timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000. + t.tv_nsec / 1e6;
+}
+
+
+//Wait for the next event, but not past the deadline (on the now_ms clock, or
+//0 for no deadline). Returns 0 if the deadline passes, or the connection is
+//lost. Events which have already arrived are returned straight away.
+xcb_generic_event_t* next_event(xcb_connection_t* c, double deadline)
+{
+	for(;;)
+	{
+		xcb_generic_event_t* e = xcb_poll_for_event(c);
+
+		if(e || xcb_connection_has_error(c))
+			return e;
+
+		int timeout = -1;
+		if(deadline != 0)
+		{
+			double left = deadline - now_ms();
+
+			if(left <= 0)
+				return 0;
+
+			//Round up, so as not to wake up just before the deadline.
+			timeout = (int)left + 1;
+		}
+
+		pollfd p;
+		p.fd = xcb_get_file_descriptor(c);
+		p.events = POLLIN;
+		p.revents = 0;
+		poll(&p, 1, timeout);
+	}
+}
+
+
+//Intern a list of atoms with one round trip. If only_if_exists is set, then
+//atoms which don't exist come back as XCB_ATOM_NONE rather than being
+//created.
+vector<xcb_atom_t> intern_atoms(xcb_connection_t* c, const vector<string>& names, const vector<bool>& only_if_exists)
+{
+	vector<xcb_intern_atom_cookie_t> cookies;
+	for(unsigned int i = 0; i < names.size(); i++)
+		cookies.push_back(xcb_intern_atom(c, only_if_exists[i], names[i].size(), names[i].c_str()));
+
+	vector<xcb_atom_t> atoms;
+	for(unsigned int i = 0; i < names.size(); i++)
+	{
+		xcb_intern_atom_reply_t* r = xcb_intern_atom_reply(c, cookies[i], 0);
+		atoms.push_back(r ? r->atom : XCB_ATOM_NONE);
+		free(r);
+	}
+
+	round_trips++;
+	return atoms;
+}
+
+
+//The contents of a property. If it's being streamed, then the data is
+//written out rather than kept.
+struct PropertyData
+{
+	xcb_atom_t type;
+	int format;
+	vector<unsigned char> data;
+	unsigned long bytes;
+};
+
+
+//Read a whole property, and delete it. The first request asks for as much as
+//will fit in one reply, and then the rest (if any) is asked for all at once.
+//8 bit data is written to fd (unless it's -1) as each reply is collected;
+//ok is cleared if that fails.
+PropertyData read_property(xcb_connection_t* c, xcb_window_t w, xcb_atom_t property, xcb_atom_t incr, int fd, bool& ok)
+{
+	//The amount to read at once, in 32 bit units, leaving room for the
+	//reply header.
+	uint32_t window = xcb_get_maximum_request_length(c) - 64;
+
+	PropertyData p;
+	p.type = XCB_ATOM_NONE;
+	p.format = 0;
+	p.bytes = 0;
+
+	vector<xcb_get_property_cookie_t> cookies;
+	cookies.push_back(xcb_get_property(c, 1, w, property, XCB_GET_PROPERTY_TYPE_ANY, 0, window));
+
+	for(unsigned int i = 0; i < cookies.size(); i++)
+	{
+		xcb_get_property_reply_t* r = xcb_get_property_reply(c, cookies[i], 0);
+
+		if(r == 0)
+			break;
+
+		if(i == 0)
+		{
+			round_trips++;
+			p.type = r->type;
+			p.format = r->format;
+
+			//Ask for everything else in one go. Each request deletes the
+			//property if it reads to the end, so only the last one does.
+			uint32_t total = (xcb_get_property_value_length(r) + r->bytes_after + 3) / 4;
+			for(uint32_t offset = window; offset < total; offset += window)
+				cookies.push_back(xcb_get_property(c, 1, w, property, XCB_GET_PROPERTY_TYPE_ANY, offset, window));
+
+			if(cookies.size() > 1)
+				round_trips++;
+		}
+
+		const unsigned char* data = (const unsigned char*)xcb_get_property_value(r);
+		int len = xcb_get_property_value_length(r);
+
+		if(r->type != p.type || r->format != p.format)
+			len = 0;
+
+		if(fd >= 0 && p.format == 8 && p.type != incr)
+		{
+			if(ok && !write_all(fd, data, len))
+			{
+				LOG(LOG_ERROR) << "Writing the data failed: " << strerror(errno) << endl;
+				ok = 0;
+			}
+		}
+		else
+			p.data.insert(p.data.end(), data, data + len);
+
+		p.bytes += len;
+		free(r);
+	}
+
+	LOG(LOG_DEBUG) << "Read " << p.bytes << " bytes in " << cookies.size() << " requests.\n";
+
+	return p;
+}
+
+
+int main(int argc, char** argv)
+{
+	init_log_level();
+
+	bool stream = 0;
+
+	//The same defaults as paste.
+	PasteTimeouts timeouts = {5000, 10000, 10000};
+
+	int first_arg = 1;
+	for(; first_arg < argc; first_arg++)
+	{
+		if(argv[first_arg] == string("-stream"))
+			stream = 1;
+		else if(argv[first_arg] == string("-timeout") && first_arg + 1 < argc)
+		{
+			if(!parse_timeouts(argv[++first_arg], timeouts))
+			{
+				LOG(LOG_ERROR) << "Expected -timeout targets[,convert[,incr_chunk]] in milliseconds.\n";
+				return 6;
+			}
+		}
+		else if(argv[first_arg][0] == '-')
+		{
+			bool help = argv[first_arg] == string("-h") || argv[first_arg] == string("-help");
+
+			cerr << "Usage: paste-xcb [-stream] [-timeout targets[,convert[,incr_chunk]]] [<clipboard> [type1 [type2 [ ... ] ] ] ]\n"
+			        "\n"
+			        "An XCB version of paste, for comparing the two. It only does ordinary\n"
+			        "pastes of exact types: patterns, -shm, -compress, -batch, -speculate,\n"
+			        "-watch and XDnD need paste.\n";
+			return help ? 0 : 6;
+		}
+		else
+			break;
+	}
+
+	int screen_num;
+	xcb_connection_t* c = xcb_connect(0, &screen_num);
+
+	if(xcb_connection_has_error(c))
+	{
+		LOG(LOG_ERROR) << "Could not connect to the display.\n";
+		return 5;
+	}
+
+	const xcb_setup_t* setup = xcb_get_setup(c);
+	xcb_screen_iterator_t s = xcb_setup_roots_iterator(setup);
+	for(int i = 0; i < screen_num; i++)
+		xcb_screen_next(&s);
+
+	//We need a target window for the pasted data to be sent to. It does not
+	//need to be mapped, but we need PropertyNotify events for INCR.
+	xcb_window_t w = xcb_generate_id(c);
+	uint32_t events = XCB_EVENT_MASK_PROPERTY_CHANGE;
+	xcb_create_window(c, XCB_COPY_FROM_PARENT, w, s.data->root, 0, 0, 100, 100, 0, XCB_WINDOW_CLASS_INPUT_OUTPUT,
+	                  s.data->root_visual, XCB_CW_EVENT_MASK, &events);
+
+	//The names of everything we need. The selection is PRIMARY by default,
+	//and the rest of the arguments are the types in order of preference.
+	vector<string> names;
+	vector<bool> only_if_exists;
+	names.push_back("TARGETS"); only_if_exists.push_back(0);
+	names.push_back("INCR"); only_if_exists.push_back(0);
+	names.push_back(argc > first_arg ? argv[first_arg] : "PRIMARY"); only_if_exists.push_back(0);
+
+	//A type which does not exist can't be offered, so there's no need to
+	//create it.
+	for(int i = first_arg + 1; i < argc; i++)
+	{
+		names.push_back(argv[i]);
+		only_if_exists.push_back(1);
+	}
+
+	if(argc <= first_arg + 1)
+	{
+		names.push_back("STRING");
+		only_if_exists.push_back(1);
+	}
+
+	//The maximum request size is fetched along with the atoms.
+	xcb_prefetch_maximum_request_length(c);
+	vector<xcb_atom_t> atoms = intern_atoms(c, names, only_if_exists);
+
+	xcb_atom_t targets = atoms[0];
+	xcb_atom_t incr = atoms[1];
+	xcb_atom_t sel = atoms[2];
+	vector<xcb_atom_t> preferences(atoms.begin() + 3, atoms.end());
+
+	//Request a list of possible conversions, using the selection as the
+	//property, as paste does.
+	xcb_convert_selection(c, w, sel, targets, sel, XCB_CURRENT_TIME);
+	xcb_flush(c);
+
+	//When the current phase started: the last conversion, or the last
+	//request for an INCR chunk.
+	double phase_start = now_ms();
+
+	xcb_atom_t requested = targets;
+	bool incr_in_progress = 0;
+	bool ok = 1;
+	PropertyData result;
+	result.bytes = 0;
+
+	for(;;)
+	{
+		int timeout = incr_in_progress ? timeouts.incr_chunk : requested == targets ? timeouts.targets : timeouts.convert;
+		xcb_generic_event_t* e = next_event(c, timeout ? phase_start + timeout : 0);
+
+		if(e == 0 && xcb_connection_has_error(c))
+		{
+			LOG(LOG_ERROR) << "Lost the connection to the display.\n";
+			return 5;
+		}
+		else if(e == 0)
+		{
+			LOG(LOG_ERROR) << "Timed out waiting for the owner.\n";
+			return 8;
+		}
+
+		int type = e->response_type & ~0x80;
+		bool have_data = 0;
+
+		if(type == XCB_SELECTION_NOTIFY)
+		{
+			xcb_selection_notify_event_t* n = (xcb_selection_notify_event_t*)e;
+
+			if(n->target != requested)
+			{
+				free(e);
+				continue;
+			}
+
+			round_trips++;
+
+			if(n->property == XCB_ATOM_NONE)
+			{
+				//If the selection can not be converted, quit with error 2.
+				//If TARGETS can not be converted (nothing owns the selection)
+				//then quit with code 3.
+				LOG(LOG_DEBUG) << "Conversion refused.\n";
+				return requested == targets ? 3 : 2;
+			}
+
+			//TARGETS is never streamed.
+			result = read_property(c, w, sel, incr, requested == targets || !stream ? -1 : STDOUT_FILENO, ok);
+
+			if(result.type == incr)
+			{
+				//Reading the INCR property deleted it, which asks for the
+				//first chunk.
+				LOG(LOG_INFO) << "Incremental transfer starting.\n";
+				incr_in_progress = 1;
+				result.data.clear();
+				result.bytes = 0;
+				xcb_flush(c);
+				phase_start = now_ms();
+			}
+			else
+				have_data = 1;
+		}
+		else if(type == XCB_PROPERTY_NOTIFY && incr_in_progress)
+		{
+			xcb_property_notify_event_t* n = (xcb_property_notify_event_t*)e;
+
+			if(n->window == w && n->atom == sel && n->state == XCB_PROPERTY_NEW_VALUE)
+			{
+				//The next chunk has arrived. Reading it deletes it, which
+				//asks for the one after.
+				PropertyData chunk = read_property(c, w, sel, incr, stream ? STDOUT_FILENO : -1, ok);
+				xcb_flush(c);
+				phase_start = now_ms();
+
+				if(chunk.bytes == 0)
+				{
+					LOG(LOG_INFO) << "Incremental transfer complete: " << result.bytes << " bytes.\n";
+					incr_in_progress = 0;
+					have_data = 1;
+				}
+				else
+				{
+					result.data.insert(result.data.end(), chunk.data.begin(), chunk.data.end());
+					result.bytes += chunk.bytes;
+				}
+			}
+		}
+
+		free(e);
+
+		if(!have_data)
+			continue;
+
+		if(requested == targets)
+		{
+			//Pick the most preferred type which is offered. The list of
+			//targets is a list of atoms, but some programs get the type
+			//wrong, in which case try STRING, as paste does.
+			xcb_atom_t best = XCB_ATOM_NONE;
+			const uint32_t* offered = (const uint32_t*)(result.data.empty() ? 0 : &result.data[0]);
+			size_t n = result.format == 32 ? result.bytes / 4 : 0;
+
+			for(unsigned int i = 0; i < preferences.size() && best == XCB_ATOM_NONE; i++)
+				for(size_t j = 0; j < n && preferences[i] != XCB_ATOM_NONE; j++)
+					if(offered[j] == preferences[i])
+						best = preferences[i];
+
+			if(result.format != 32)
+				for(unsigned int i = 0; i < preferences.size(); i++)
+					if(preferences[i] == XCB_ATOM_STRING)
+						best = XCB_ATOM_STRING;
+
+			if(best == XCB_ATOM_NONE)
+			{
+				LOG(LOG_ERROR) << "No matching datatypes.\n";
+				return 1;
+			}
+
+			requested = best;
+			xcb_convert_selection(c, w, sel, best, sel, XCB_CURRENT_TIME);
+			xcb_flush(c);
+			phase_start = now_ms();
+		}
+		else
+		{
+			if(!stream && !result.data.empty())
+				ok = write_all(STDOUT_FILENO, &result.data[0], result.data.size());
+
+			if(!ok)
+				return 7;
+
+			LOG(LOG_INFO) << "Pasted " << result.bytes << " bytes using " << round_trips << " round trips.\n";
+			xcb_disconnect(c);
+			return 0;
+		}
+	}
+}
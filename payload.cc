@@ -0,0 +1,205 @@
+#include "payload.h"
+#include "log.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+using namespace std;
+
+//Files up to this size are read in to memory rather than mapped.
+static const size_t copy_limit = 1 << 16;
+
+Payload::Payload()
+:is_file(0), mapping(0), mapped_size(0), map_fd(-1), copied(0), file_size(0), pinned_size(0), have_size(0), last_used(0), pins(0)
+{
+}
+
+Payload::Payload(const string& data)
+:memory(data), is_file(0), mapping(0), mapped_size(0), map_fd(-1), copied(0), file_size(0), pinned_size(0), have_size(0), last_used(0), pins(0)
+{
+}
+
+Payload::Payload(const Payload& p)
+:memory(p.memory), filename(p.filename), is_file(p.is_file), mapping(0), mapped_size(0), map_fd(-1), copied(0), file_size(p.file_size), pinned_size(0), have_size(p.have_size), last_used(0), pins(0)
+{
+}
+
+Payload& Payload::operator=(const Payload& p)
+{
+	if(this != &p)
+	{
+		unmap();
+		memory = p.memory;
+		filename = p.filename;
+		is_file = p.is_file;
+		file_size = p.file_size;
+		have_size = p.have_size;
+	}
+	return *this;
+}
+
+Payload::~Payload()
+{
+	unmap();
+}
+
+Payload Payload::from_file(const string& filename)
+{
+	Payload p;
+	p.filename = filename;
+	p.is_file = 1;
+	return p;
+}
+
+void Payload::unmap()
+{
+	if(mapping)
+		munmap(mapping, mapped_size);
+	if(map_fd != -1)
+		close(map_fd);
+	mapping = 0;
+	mapped_size = 0;
+	map_fd = -1;
+	copy.clear();
+	copied = 0;
+}
+
+size_t Payload::size()
+{
+	if(!is_file)
+		return memory.size();
+
+	if(pins)
+		return pinned_size;
+
+	if(mapping || copied)
+		return file_size;
+
+	if(!have_size)
+	{
+		struct stat s;
+		file_size = stat(filename.c_str(), &s) == 0 ? s.st_size : 0;
+		have_size = 1;
+	}
+
+	return file_size;
+}
+
+const unsigned char* Payload::data()
+{
+	static const unsigned char empty[1] = {0};
+
+	last_used = time(0);
+
+	if(!is_file)
+		return reinterpret_cast<const unsigned char*>(memory.data());
+
+	if(!mapping && !copied)
+	{
+		int fd = open(filename.c_str(), O_RDONLY);
+
+		if(fd == -1)
+		{
+			LOG(LOG_ERROR) << "Could not open " << filename << endl;
+			file_size = 0;
+			have_size = 1;
+			return empty;
+		}
+
+		struct stat s;
+		fstat(fd, &s);
+		file_size = s.st_size;
+		have_size = 1;
+
+		if(file_size <= copy_limit)
+		{
+			//The file may have shrunk since fstat, so keep whatever
+			//was actually read.
+			copy.resize(file_size);
+			size_t got = 0;
+			ssize_t n = 1;
+
+			while(got < file_size && (n = read(fd, &copy[got], file_size - got)) != 0)
+				if(n > 0)
+					got += n;
+				else if(errno != EINTR)
+					break;
+
+			copy.resize(got);
+			file_size = got;
+			copied = 1;
+		}
+		else
+		{
+			void* m = mmap(0, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+			if(m == MAP_FAILED)
+			{
+				LOG(LOG_ERROR) << "Could not map " << filename << endl;
+				file_size = 0;
+			}
+			else
+			{
+				mapping = (unsigned char*)m;
+				mapped_size = file_size;
+				map_fd = fd;
+				LOG(LOG_INFO) << "Mapped " << filename << " (" << mapped_size << " bytes)\n";
+			}
+		}
+
+		if(map_fd != fd)
+			close(fd);
+	}
+
+	if(copied)
+		return copy.empty() ? empty : reinterpret_cast<const unsigned char*>(copy.data());
+
+	return mapping ? mapping : empty;
+}
+
+bool Payload::intact()
+{
+	if(!is_file)
+		return true;
+
+	//This maps the file again if the mapping was released, in which case
+	//the file may be a different size to the one being sent.
+	data();
+
+	if(pins && file_size != pinned_size)
+		return false;
+
+	struct stat s;
+	return !mapping || (fstat(map_fd, &s) == 0 && (size_t)s.st_size >= mapped_size);
+}
+
+void Payload::pin()
+{
+	//Hold on to the size as it is now, so that a transfer of the file
+	//can't be changed part way through.
+	if(pins++ == 0 && is_file)
+	{
+		data();
+		pinned_size = file_size;
+	}
+}
+
+bool Payload::release_if_idle(time_t now, time_t max_idle)
+{
+	if((mapping || copied) && now - last_used >= max_idle)
+	{
+		LOG(LOG_INFO) << "Releasing idle mapping of " << filename << endl;
+		unmap();
+		return true;
+	}
+	else
+		return false;
+}
+
+void release_idle_payloads(PayloadStore& store, time_t max_idle)
+{
+	time_t now = time(0);
+	for(PayloadStore::iterator i = store.begin(); i != store.end(); i++)
+		i->second.release_if_idle(now, max_idle);
+}
@@ -0,0 +1,83 @@
+#ifndef X_CLIPBOARD_PAYLOAD_H
+#define X_CLIPBOARD_PAYLOAD_H
+
+#include <X11/Xlib.h>
+#include <string>
+#include <map>
+#include <ctime>
+
+//A piece of data which can be given to a requestor. It is either a string
+//held in memory (eg a URL), or the contents of a file. Files are not read at
+//startup, since nobody may ever ask for them. Instead, the file is mapped in
+//to memory the first time the data is needed, and served directly from the
+//mapping. Mappings which have not been used for a while can be released,
+//and will be mapped again if they are needed again.
+//
+//Other programs can change the file while it's mapped. Reading past the end
+//of a file which has been truncated kills us with SIGBUS, so small files are
+//simply copied, and anything sending a large one should check intact() before
+//reading each part of it.
+class Payload
+{
+	public:
+		Payload();
+		explicit Payload(const std::string& data);
+
+		//Copies share the file or string, but not the mapping.
+		Payload(const Payload&);
+		Payload& operator=(const Payload&);
+		~Payload();
+
+		static Payload from_file(const std::string& filename);
+
+		//The data, mapping the file if necessary. The pointer is valid
+		//until the mapping is released, so it should be fetched again
+		//rather than kept.
+		const unsigned char* data();
+
+		//The size can be found without mapping the file. While the
+		//payload is pinned, this is the size when it was pinned.
+		size_t size();
+
+		//Whether all of the data can still be read: false if the file has
+		//been truncated since it was mapped, or has changed size since
+		//the payload was pinned.
+		bool intact();
+
+		//A payload which is being sent to a requestor is pinned, so that
+		//whatever owns it knows not to throw it away, and so that its size
+		//stays the same for the whole transfer.
+		void pin();
+		void unpin() { pins--; }
+		bool pinned() const { return pins != 0; }
+
+		//Release the mapping if the data has not been used for max_idle
+		//seconds. Returns true if a mapping was released.
+		bool release_if_idle(time_t now, time_t max_idle);
+
+	private:
+		void unmap();
+
+		std::string memory;
+		std::string filename;
+		bool is_file;
+
+		unsigned char* mapping;
+		size_t mapped_size;
+		int map_fd;             //Kept open while mapped, to check the size
+		std::string copy;       //Small files are read in to here instead
+		bool copied;
+		size_t file_size;
+		size_t pinned_size;
+		bool have_size;
+		time_t last_used;
+		int pins;
+};
+
+//The data we are able to provide, by target.
+typedef std::map<Atom, Payload> PayloadStore;
+
+//Release the mappings of all payloads which have been idle for max_idle seconds.
+void release_idle_payloads(PayloadStore& store, time_t max_idle);
+
+#endif
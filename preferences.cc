@@ -0,0 +1,234 @@
+#include "preferences.h"
+#include "atoms.h"
+#include "log.h"
+#include <fnmatch.h>
+#include <cstdlib>
+#include <cstring>
+using namespace std;
+
+const int TargetPreferences::NOT_ACCEPTABLE;
+
+//The characters which make a rule a pattern for fnmatch.
+static const char* const wildcards = "*?[";
+
+
+//How specific a pattern is: the number of characters which must match
+//exactly. Wildcards and bracket expressions (eg [abc]) don't count.
+static int literal_characters(const string& pattern)
+{
+	int n = 0;
+
+	for(size_t i = 0; i < pattern.size(); i++)
+	{
+		if(pattern[i] == '[')
+		{
+			//A ] straight after the [ (or [!) is part of the set.
+			size_t j = i + 1;
+			if(j < pattern.size() && pattern[j] == '!')
+				j++;
+			if(j < pattern.size() && pattern[j] == ']')
+				j++;
+
+			size_t close = pattern.find(']', j);
+
+			//fnmatch treats a [ which is never closed as a literal.
+			if(close == string::npos)
+				n++;
+			else
+				i = close;
+		}
+		else if(pattern[i] == '\\' && i + 1 < pattern.size())
+		{
+			n++;
+			i++;
+		}
+		else if(pattern[i] != '*' && pattern[i] != '?')
+			n++;
+	}
+
+	return n;
+}
+
+TargetPreferences::TargetPreferences()
+:has_patterns(0), used(0), built(0)
+{
+}
+
+
+void TargetPreferences::add(const string& text)
+{
+	Rule r;
+	r.name = text;
+	r.atom = None;
+
+	//A quality is only recognised at the very end, since MIME types can
+	//have other parameters, eg text/plain;charset=utf-8.
+	int quality = 1000;
+	size_t q = text.rfind(";q=");
+	if(q != string::npos)
+	{
+		const char* begin = text.c_str() + q + 3;
+		char* end;
+		double value = strtod(begin, &end);
+
+		if(end != begin && *end == 0 && value >= 0 && value <= 1)
+		{
+			quality = (int)(value * 1000 + .5);
+			r.name = text.substr(0, q);
+		}
+	}
+
+	r.pattern = strpbrk(r.name.c_str(), wildcards) != 0;
+	r.specificity = r.pattern ? literal_characters(r.name) : 0;
+
+	//Sort by quality first, and then by order.
+	r.rank = quality == 0 ? NOT_ACCEPTABLE : (1000 - quality) * 65536 + rules.size();
+	has_patterns |= r.pattern;
+
+	rules.push_back(r);
+	built = 0;
+}
+
+
+void TargetPreferences::register_atoms()
+{
+	for(unsigned int i = 0; i < rules.size(); i++)
+		if(!rules[i].pattern)
+			register_atom(rules[i].name.c_str(), &rules[i].atom);
+}
+
+
+Atom TargetPreferences::first() const
+{
+	const Rule* best = 0;
+
+	for(unsigned int i = 0; i < rules.size(); i++)
+		if(best == 0 || rules[i].rank < best->rank)
+			best = &rules[i];
+
+	if(best == 0 || best->pattern || best->rank == NOT_ACCEPTABLE)
+		return None;
+
+	return best->atom;
+}
+
+
+//Put the exact targets in to the table. This has to wait until the atoms
+//have been interned.
+void TargetPreferences::build()
+{
+	Slot empty = {None, 0};
+	table.assign(16, empty);
+	used = 0;
+
+	for(unsigned int i = 0; i < rules.size(); i++)
+		if(!rules[i].pattern && rules[i].atom != None && find(rules[i].atom) == 0)
+			insert(rules[i].atom, rules[i].rank);
+
+	built = 1;
+}
+
+
+//Atoms are mostly small consecutive numbers, so the low bits are already a
+//good enough hash.
+const TargetPreferences::Slot* TargetPreferences::find(Atom a) const
+{
+	if(table.empty())
+		return 0;
+
+	unsigned long mask = table.size() - 1;
+	for(unsigned long i = a & mask; table[i].atom != None; i = (i + 1) & mask)
+		if(table[i].atom == a)
+			return &table[i];
+
+	return 0;
+}
+
+
+void TargetPreferences::insert(Atom a, int rank)
+{
+	if((used + 1) * 2 > table.size())
+	{
+		vector<Slot> old;
+		old.swap(table);
+
+		Slot empty = {None, 0};
+		table.assign(old.size() * 2, empty);
+		used = 0;
+
+		for(unsigned int i = 0; i < old.size(); i++)
+			if(old[i].atom != None)
+				insert(old[i].atom, old[i].rank);
+	}
+
+	unsigned long mask = table.size() - 1;
+	unsigned long i = a & mask;
+	while(table[i].atom != None)
+		i = (i + 1) & mask;
+
+	table[i].atom = a;
+	table[i].rank = rank;
+	used++;
+}
+
+
+int TargetPreferences::resolve(Display* disp, const Atom* atoms, int n)
+{
+	if(!built)
+		build();
+
+	//Without patterns, everything is already in the table, or isn't
+	//wanted.
+	if(!has_patterns)
+		return 0;
+
+	vector<Atom> unknown;
+	for(int i = 0; i < n; i++)
+		if(atoms[i] != None && find(atoms[i]) == 0)
+			unknown.push_back(atoms[i]);
+
+	if(unknown.empty())
+		return 0;
+
+	int round_trips = prefetch_atom_names(disp, &unknown[0], unknown.size());
+
+	for(unsigned int i = 0; i < unknown.size(); i++)
+	{
+		if(find(unknown[i]))
+			continue;
+
+		//The most specific matching pattern wins, and then the best
+		//ranked, so a q=0 pattern can exclude part of a broader one.
+		//Targets which match nothing go in the table as well, so they're
+		//not looked at again. The targets which ask for something other
+		//than the data itself are never matched by a pattern.
+		string name = GetAtomName(disp, unknown[i]);
+		const Rule* best = 0;
+		bool special = unknown[i] == XA_TARGETS || unknown[i] == XA_multiple || unknown[i] == XA_clipboard_shm || unknown[i] == XA_clipboard_zlib;
+
+		for(unsigned int j = 0; j < rules.size() && !special; j++)
+		{
+			const Rule& r = rules[j];
+
+			if(!r.pattern || fnmatch(r.name.c_str(), name.c_str(), 0) != 0)
+				continue;
+
+			if(best == 0 || r.specificity > best->specificity || (r.specificity == best->specificity && r.rank < best->rank))
+				best = &r;
+		}
+
+		int rank = best ? best->rank : NOT_ACCEPTABLE;
+
+		LOG(LOG_DEBUG) << name << (rank == NOT_ACCEPTABLE ? " matches no pattern.\n" : " matches a pattern.\n");
+		insert(unknown[i], rank);
+	}
+
+	return round_trips;
+}
+
+
+int TargetPreferences::rank(Atom a) const
+{
+	const Slot* s = find(a);
+	return s ? s->rank : NOT_ACCEPTABLE;
+}
@@ -0,0 +1,94 @@
+#ifndef X_CLIPBOARD_PREFERENCES_H
+#define X_CLIPBOARD_PREFERENCES_H
+
+#include <X11/Xlib.h>
+#include <climits>
+#include <string>
+#include <vector>
+
+//The targets a paste will accept, and how much each one is wanted. Picking
+//a target means looking up every atom offered (eg in TARGETS), so the
+//preferences are kept in a small hash table keyed by atom, and a lookup
+//costs no round trips, no string comparisons and no allocation.
+//
+//Each rule is either the name of a target, eg image/png, or a pattern (any
+//rule with *, ? or [ in it, as for fnmatch), eg image/* or */*, which
+//matches any target whose name matches. Either can be
+//followed by a quality, as in HTTP, eg image/*;q=0.8. Higher qualities are
+//preferred, and for equal qualities, rules added first are preferred. A
+//quality of 0 means that the target is not acceptable at all, so
+//"image/*, image/gif;q=0" accepts any image other than a GIF. A target
+//named exactly by a rule uses that rule, even if it also matches a
+//pattern. When several patterns match, the most specific one (the one with
+//the most characters outside of wildcards) wins, as in HTTP, so
+//"*/*, image/*;q=0" accepts anything except images. Equally specific
+//patterns are ranked as usual.
+//
+//The names of the exact targets are interned with everything else at
+//startup. Patterns can't be interned, so they are matched against the names
+//of the targets offered the first time each target is seen, and the result
+//goes in to the table, so each name is only ever fetched and matched once.
+class TargetPreferences
+{
+	public:
+		static const int NOT_ACCEPTABLE = INT_MAX;
+
+		TargetPreferences();
+
+		//Add a rule, less preferred than those already added.
+		void add(const std::string& rule);
+
+		//Register the atoms for the targets named exactly, so that
+		//intern_atoms fills them in. Call this once all of the rules have
+		//been added.
+		void register_atoms();
+
+		bool empty() const { return rules.empty(); }
+
+		//The most preferred target, if the best rule names one exactly,
+		//otherwise None. Only valid after intern_atoms.
+		Atom first() const;
+
+		//Make sure that rank() knows about every atom in the list, by
+		//fetching the names of any which haven't been matched against the
+		//patterns yet (with a single round trip). Returns the number of
+		//round trips made (0 or 1). Only valid after intern_atoms.
+		int resolve(Display* disp, const Atom* atoms, int n);
+
+		//How much a target is wanted: closer to zero is better, and
+		//NOT_ACCEPTABLE means not at all. Only targets which have been
+		//resolved can match a pattern.
+		int rank(Atom a) const;
+
+	private:
+		struct Rule
+		{
+			std::string name;
+			bool pattern;
+			int specificity;        //Characters in a pattern outside of wildcards
+			int rank;
+			Atom atom;
+		};
+
+		//A slot in the hash table. Atom None marks an empty slot.
+		struct Slot
+		{
+			Atom atom;
+			int rank;
+		};
+
+		void build();
+		void insert(Atom a, int rank);
+		const Slot* find(Atom a) const;
+
+		std::vector<Rule> rules;
+		bool has_patterns;
+
+		//Open addressing, with linear probing. The size is a power of two,
+		//and is kept at least twice the number used.
+		std::vector<Slot> table;
+		unsigned long used;
+		bool built;
+};
+
+#endif
@@ -0,0 +1,1426 @@
+#include "requester.h"
+#include "atoms.h"
+#include "log.h"
+#include "metrics.h"
+#include "shared.h"
+#include <X11/Xatom.h>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <zlib.h>
+using namespace std;
+
+//See paste.cc for a description of how pasting works.
+
+unsigned long total_round_trips = 0;
+
+static const PasteTimeouts no_timeouts = {0, 0, 0};
+
+
+//The earlier of two deadlines, where 0 means never.
+static double earliest(double a, double b)
+{
+	if(a == 0)
+		return b;
+	else if(b == 0)
+		return a;
+	else
+		return min(a, b);
+}
+
+
+//The size of an item as Xlib stores it. 32 bit items are stored as longs,
+//which may be bigger than 4 bytes.
+static size_t item_size(int format)
+{
+	return format == 8 ? 1 : format == 16 ? sizeof(short) : sizeof(long);
+}
+
+
+//The most space reserved up front for an INCR transfer. The size the owner
+//gives is only a lower bound, and it's only a hint, so there's no need to
+//trust it with more than this.
+static const size_t max_incr_reserve = 64 << 20;
+
+
+//Whether a SelectionNotify is the reply to a conversion we asked for. Owners
+//echo the timestamp of the request, so when the request had a real
+//timestamp, a reply to an older request for the same target (eg from the
+//previous owner, when pasting again because the selection changed) can be
+//told apart from the reply we're waiting for. Several requesters can share a
+//window, and may be asking for the same target (eg two for _X_CLIPBOARD_SHM
+//when speculating), so the reply must also name our property, or None if it
+//was refused. A refusal from someone else's request may still be taken as
+//ours, but that only costs a round trip.
+static bool is_reply(const XEvent& e, Window w, Atom target, Atom property, Time t)
+{
+	return e.type == SelectionNotify && e.xselection.requestor == w && e.xselection.target == target
+	       && (e.xselection.property == property || e.xselection.property == None)
+	       && (t == CurrentTime || e.xselection.time == t);
+}
+
+
+//Whether a list of targets (eg TARGETS) includes a target.
+static bool offers(const Property& p, Atom target)
+{
+	const Atom* offered = (const Atom*)p.data;
+	unsigned long n = (p.type == XA_ATOM || p.type == XA_TARGETS) && p.format == 32 ? p.nitems : 0;
+
+	for(unsigned long i = 0; i < n; i++)
+		if(offered[i] == target)
+			return true;
+
+	return false;
+}
+
+
+//This fetches all the data from a property
+//
+//XGetWindowProperty returns at most long_length 32 bit units of data, and
+//tells us (via bytes_after) how much is left. So first we ask for no data at
+//all, which costs a single round trip and tells us the type, format and total
+//size. Then we fetch the data using exactly the right size. If the property
+//is larger than the biggest request the server is prepared to handle, then
+//it is fetched in consecutive windows (by increasing long_offset) which are
+//copied in to a single buffer allocated up front.
+//
+//When streaming to fd, there's no buffer to allocate, so there's no need to
+//know the size in advance. The first request asks for a whole window, and
+//8 bit data is written straight out of each of Xlib's replies as it
+//arrives. This saves the probe's round trip, and only one window is ever
+//held in memory. Anything else (eg INCR or a list of atoms) is read in to a
+//buffer as normal.
+static Property fetch_property(Display* disp, Window w, Atom property, int fd, bool& ok)
+{
+	Atom actual_type;
+	int actual_format;
+	unsigned long nitems;
+	unsigned long bytes_after;
+	unsigned char *ret = 0;
+
+	unsigned long round_trips = 0;
+	unsigned long bytes_copied = 0;
+	unsigned long bytes_written = 0;
+
+	//The amount to read at once, in 32 bit units.
+	long window = XExtendedMaxRequestSize(disp);
+	if(window == 0)
+		window = XMaxRequestSize(disp);
+
+	//Probe the size of the property, or get the first window of data.
+	long first = fd >= 0 ? window : 0;
+	if(XGetWindowProperty(disp, w, property, 0, first, False, AnyPropertyType,
+						&actual_type, &actual_format, &nitems, &bytes_after,
+						&ret) != Success)
+		actual_type = None;
+	round_trips++;
+
+	Property p = {0, actual_format, 0, actual_type};
+	bool streaming = fd >= 0 && actual_format == 8 && actual_type != XA_INCR;
+
+	if(actual_type != None)
+	{
+		unsigned long total_items = nitems + bytes_after / (actual_format/8);
+		size_t size = item_size(actual_format);
+
+		//Allocate one extra byte for a terminating null, as Xlib does.
+		if(!streaming)
+			p.data = (unsigned char*)malloc(total_items * size + 1);
+
+		long offset = first;
+		for(;;)
+		{
+			nitems = min(nitems, total_items - p.nitems);
+
+			if(streaming)
+			{
+				if(ok && !write_all(fd, ret, nitems))
+				{
+					LOG(LOG_ERROR) << "Writing the data failed: " << strerror(errno) << endl;
+					ok = 0;
+				}
+				bytes_written += nitems;
+			}
+			else
+			{
+				memcpy(p.data + p.nitems * size, ret, nitems * size);
+				bytes_copied += nitems * size;
+			}
+
+			XFree(ret);
+			ret = 0;
+			p.nitems += nitems;
+
+			if(bytes_after == 0 || (nitems == 0 && offset != first))
+				break;
+
+			long length = min<unsigned long>(window, (bytes_after + 3) / 4);
+
+			//Guard against the property having changed since it was probed.
+			if(XGetWindowProperty(disp, w, property, offset, length, False, AnyPropertyType,
+								&actual_type, &actual_format, &nitems, &bytes_after,
+								&ret) != Success)
+				break;
+			round_trips++;
+
+			if(actual_type == None || actual_format != p.format)
+				nitems = bytes_after = 0;
+
+			offset += length;
+		}
+
+		if(!streaming)
+			p.data[p.nitems * size] = 0;
+	}
+
+	XFree(ret);
+
+	LOG(LOG_DEBUG) << endl;
+	LOG(LOG_DEBUG) << "Actual type: " << GetAtomName(disp, p.type) << endl;
+	LOG(LOG_DEBUG) << "Actual format: " << p.format << endl;
+	LOG(LOG_DEBUG) << "Number of items: " << p.nitems <<  endl;
+	LOG(LOG_DEBUG) << "Round trips: " << round_trips << endl;
+	LOG(LOG_DEBUG) << "Bytes copied: " << bytes_copied << endl;
+	LOG(LOG_DEBUG) << "Bytes written: " << bytes_written << endl;
+
+	total_round_trips += round_trips;
+
+	return p;
+}
+
+
+const unsigned char* wire_data(const Property& p, vector<unsigned char>& buf)
+{
+	if(p.format != 32 || sizeof(long) == 4 || p.data == 0)
+		return p.data;
+
+	buf.resize(p.nitems * 4);
+	const long* items = (const long*)p.data;
+
+	for(unsigned long i = 0; i < p.nitems; i++)
+	{
+		uint32_t item = items[i];
+		memcpy(&buf[i * 4], &item, 4);
+	}
+
+	return buf.empty() ? 0 : &buf[0];
+}
+
+
+Property read_property(Display* disp, Window w, Atom property)
+{
+	bool ok = 1;
+	return fetch_property(disp, w, property, -1, ok);
+}
+
+
+Property stream_property(Display* disp, Window w, Atom property, int fd, bool& ok)
+{
+	return fetch_property(disp, w, property, fd, ok);
+}
+
+
+// This function takes a list of targets which can be converted to (atom_list, nitems)
+// and the preferences. It returns the most preferred target in atom_list:
+// ie it finds the best match. The names are only needed if there are
+// patterns to match (or for the log).
+Atom pick_target_from_list(Display* disp, const Atom* atom_list, int nitems, TargetPreferences& preferences, Atom except)
+{
+	Atom to_be_requested = None;
+	//This is the same as the maximum priority, which is not acceptable.
+	int priority = TargetPreferences::NOT_ACCEPTABLE;
+
+	total_round_trips += preferences.resolve(disp, atom_list, nitems);
+
+	//Get all the names in one round trip, rather than one per target.
+	if(LOG_ENABLED(LOG_DEBUG))
+		prefetch_atom_names(disp, atom_list, nitems);
+
+	for(int i = 0; i < nitems; i++)
+	{
+		LOG(LOG_DEBUG) << "Type " << i << " = " << GetAtomName(disp, atom_list[i]) << endl;
+
+		//See if this data type is allowed and of higher priority (closer to zero)
+		//than the present one.
+		int rank = preferences.rank(atom_list[i]);
+		if(rank < priority && atom_list[i] != except)
+		{
+			LOG(LOG_DEBUG) << "Will request type: " << GetAtomName(disp, atom_list[i]) << endl;
+			priority = rank;
+			to_be_requested = atom_list[i];
+		}
+	}
+
+	return to_be_requested;
+}
+
+// Finds the best target given up to three atoms provided (any can be None).
+// Useful for part of the Xdnd protocol.
+Atom pick_target_from_atoms(Display* disp, Atom t1, Atom t2, Atom t3, TargetPreferences& preferences)
+{
+	Atom atoms[3];
+	int  n = 0;
+
+	if(t1 != None)
+		atoms[n++] = t1;
+
+	if(t2 != None)
+		atoms[n++] = t2;
+
+	if(t3 != None)
+		atoms[n++] = t3;
+
+	return pick_target_from_list(disp, atoms, n, preferences);
+}
+
+
+// Finds the best target given a local copy of a property.
+Atom pick_target_from_targets(Display* disp, const Property& p, TargetPreferences& preferences, Atom except)
+{
+	//The list of targets is a list of atoms, so it should have type XA_ATOM
+	//but it may have the type TARGETS instead.
+
+	if((p.type != XA_ATOM && p.type != XA_TARGETS) || p.format != 32)
+	{
+		//This would be really broken. Targets have to be an atom list
+		//and applications should support this. Nevertheless, some
+		//seem broken (MATLAB 7, for instance), so ask for STRING
+		//next instead as the lowest common denominator
+
+		Atom fallback = XA_STRING;
+		return pick_target_from_list(disp, &fallback, 1, preferences, except);
+	}
+	else
+	{
+		Atom *atom_list = (Atom*)p.data;
+
+		return pick_target_from_list(disp, atom_list, p.nitems, preferences, except);
+	}
+}
+
+
+SelectionRequester::SelectionRequester(Display* d, Window win, Atom prop)
+:disp(d), w(win), property(prop), selection(None), requested(None), timestamp(CurrentTime),
+ negotiating(0), preferences(0), current_state(IDLE), incr_in_progress(0), incr_format(0), stream_fd(-1), stream_ok(1), streamed(0),
+ request_start(0), chunk_start(0), counting(1), wanted(None), share(0), shared_data(0), shared_size(0), compress(0), fallback_compressed(0), inflater(0),
+ inflate_finished(0)
+{
+	Property empty = {0, 0, 0, None};
+	result = empty;
+	timeouts = no_timeouts;
+}
+
+
+SelectionRequester::~SelectionRequester()
+{
+	clear();
+}
+
+
+//Throw away the data from the last paste.
+void SelectionRequester::clear()
+{
+	if(result.data != (incr_data.empty() ? 0 : &incr_data[0]) && result.data != shared_data)
+		free(result.data);
+
+	if(shared_data)
+		munmap(shared_data, shared_size);
+	shared_data = 0;
+	shared_size = 0;
+
+	if(inflater)
+	{
+		inflateEnd(inflater);
+		delete inflater;
+	}
+	inflater = 0;
+
+	Property empty = {0, 0, 0, None};
+	result = empty;
+	incr_data.clear();
+	incr_in_progress = 0;
+	incr_format = 0;
+	stream_ok = 1;
+	streamed = 0;
+}
+
+
+//When streaming, write out data which had to be read in to memory (eg
+//because it isn't 8 bit), so that it's all treated the same way.
+void SelectionRequester::write_out(Property& p)
+{
+	if(p.data)
+	{
+		unsigned long bytes = p.nitems * p.format/8;
+		vector<unsigned char> buf;
+
+		if(stream_ok && !write_all(stream_fd, wire_data(p, buf), bytes))
+		{
+			LOG(LOG_ERROR) << "Writing the data failed: " << strerror(errno) << endl;
+			stream_ok = 0;
+		}
+
+		free(p.data);
+		p.data = 0;
+		p.nitems = bytes;
+		p.format = 8;
+	}
+
+	streamed += p.nitems;
+}
+
+
+void SelectionRequester::paste(Atom s, TargetPreferences& p, Time t)
+{
+	preferences = &p;
+
+	//Request a list of possible conversions. The best one is picked when
+	//it arrives.
+	request(s, XA_TARGETS, t);
+	negotiating = 1;
+}
+
+
+void SelectionRequester::request(Atom s, Atom target, Time t)
+{
+	clear();
+	selection = s;
+	requested = target;
+	timestamp = t;
+	negotiating = 0;
+	current_state = WAITING;
+
+	XConvertSelection(disp, selection, target, property, w, t);
+	request_start = metric_now();
+}
+
+
+void SelectionRequester::request_shared(Atom s, Atom target, Time t)
+{
+	//The target we actually want is the parameter, in the property.
+	XChangeProperty(disp, w, property, XA_ATOM, 32, PropModeReplace, (unsigned char*)&target, 1);
+	request(s, XA_clipboard_shm, t);
+	wanted = target;
+}
+
+
+void SelectionRequester::request_compressed(Atom s, Atom target, Time t)
+{
+	//If zlib can't be set up (eg out of memory), the data couldn't be
+	//decompressed, so don't ask for it compressed.
+	z_stream* z = new z_stream;
+	memset(z, 0, sizeof(z_stream));
+
+	if(inflateInit(z) != Z_OK)
+	{
+		LOG(LOG_ERROR) << "Could not start decompressing. Requesting " << GetAtomName(disp, target) << " normally.\n";
+		delete z;
+		request(s, target, t);
+		return;
+	}
+
+	//As for shared memory, the target is the parameter.
+	XChangeProperty(disp, w, property, XA_ATOM, 32, PropModeReplace, (unsigned char*)&target, 1);
+	request(s, XA_clipboard_zlib, t);
+	wanted = target;
+	inflater = z;
+	inflate_finished = 0;
+}
+
+
+void SelectionRequester::request_via(Atom s, Atom target, Time t, const Property& offered)
+{
+	//offered may be our own data, which is about to be cleared.
+	bool shm = share && offers(offered, XA_clipboard_shm);
+	fallback_compressed = compress && offers(offered, XA_clipboard_zlib);
+
+	if(shm)
+		request_shared(s, target, t);
+	else if(fallback_compressed)
+		request_compressed(s, target, t);
+	else
+		request(s, target, t);
+}
+
+
+void SelectionRequester::request_preferred(Atom s, Atom target, Time t)
+{
+	fallback_compressed = compress;
+
+	if(share)
+		request_shared(s, target, t);
+	else if(compress)
+		request_compressed(s, target, t);
+	else
+		request(s, target, t);
+}
+
+
+void SelectionRequester::cancel()
+{
+	clear();
+	negotiating = 0;
+	current_state = IDLE;
+}
+
+
+double SelectionRequester::deadline() const
+{
+	if(current_state != WAITING)
+		return 0;
+
+	//INCR chunks are timed from asking for each one, everything else from
+	//XConvertSelection.
+	if(incr_in_progress)
+		return timeouts.incr_chunk ? chunk_start + timeouts.incr_chunk * 1000. : 0;
+
+	int t = requested == XA_TARGETS ? timeouts.targets : timeouts.convert;
+	return t ? request_start + t * 1000. : 0;
+}
+
+
+bool SelectionRequester::check_deadline(double now)
+{
+	double d = deadline();
+
+	if(d == 0 || now < d)
+		return false;
+
+	LOG(LOG_ERROR) << "Timed out waiting for " << (incr_in_progress ? "the next chunk of " : "") << GetAtomName(disp, requested) << endl;
+
+	//Any reply which turns up later is ignored, since we're no longer
+	//waiting. What has already been written out stays written, so keep
+	//count of it.
+	unsigned long wrote = streamed;
+	clear();
+	streamed = wrote;
+	negotiating = 0;
+	current_state = TIMED_OUT;
+	return true;
+}
+
+
+bool SelectionRequester::handle_event(const XEvent& e)
+{
+	if(current_state != WAITING)
+		return false;
+
+	if(is_reply(e, w, requested, property, timestamp))
+		return process_selection_notify(e);
+	else if(e.type == PropertyNotify && incr_in_progress && e.xproperty.window == w
+	        && e.xproperty.atom == property && e.xproperty.state == PropertyNewValue)
+		return process_incr_chunk(e);
+
+	return false;
+}
+
+
+//The owner has replied to XConvertSelection.
+bool SelectionRequester::process_selection_notify(const XEvent& e)
+{
+	Atom target = e.xselection.target;
+
+	if(counting)
+		total_round_trips++;
+	record_metric(target, target == XA_TARGETS ? PHASE_TARGETS : PHASE_CONVERT, request_start);
+
+	if(LOG_ENABLED(LOG_DEBUG))
+	{
+		Atom names[] = {e.xselection.selection, target, e.xselection.property};
+		prefetch_atom_names(disp, names, 3);
+	}
+
+	LOG(LOG_DEBUG) << "A selection notify has arrived!\n";
+	LOG(LOG_DEBUG) << hex << "Requestor = 0x" << e.xselection.requestor << dec << endl;
+	LOG(LOG_DEBUG) << "Selection atom = " << GetAtomName(disp, e.xselection.selection) << endl;
+	LOG(LOG_DEBUG) << "Target atom    = " << GetAtomName(disp, target)    << endl;
+	LOG(LOG_DEBUG) << "Property atom  = " << GetAtomName(disp, e.xselection.property) << endl;
+	LOG(LOG_DEBUG) << endl;
+
+	return process_reply(e.xselection.property != None);
+}
+
+
+bool SelectionRequester::receive(Atom s, Atom target, bool converted)
+{
+	clear();
+	selection = s;
+	requested = target;
+	negotiating = 0;
+	current_state = WAITING;
+
+	return process_reply(converted);
+}
+
+
+//The owner has converted the data in to the property, or refused.
+bool SelectionRequester::process_reply(bool converted)
+{
+	Atom target = requested;
+
+	if(requested == XA_clipboard_shm)
+		return process_shared_reply(converted);
+
+	if(!converted && requested == XA_clipboard_zlib)
+	{
+		//Asking again is a round trip of our own, even if the first
+		//request went out alongside others.
+		LOG(LOG_INFO) << "Compression refused. Requesting " << GetAtomName(disp, wanted) << " normally.\n";
+		counting = 1;
+		request(selection, wanted, timestamp);
+		return false;
+	}
+
+	if(!converted)
+	{
+		//If TARGETS can not be converted, then nothing owns the selection.
+		LOG(LOG_DEBUG) << "Conversion refused.\n";
+		current_state = negotiating ? NO_OWNER : REFUSED;
+		return true;
+	}
+
+	//Compressed data can't be written out as is.
+	bool compressed = requested == XA_clipboard_zlib;
+
+	double start = metric_now();
+	Property p = streaming() && !compressed ? stream_property(disp, w, property, stream_fd, stream_ok) : read_property(disp, w, property);
+	record_metric(target, PHASE_READ, start, p.nitems * p.format/8);
+
+	if(p.type == XA_INCR)
+	{
+		//The data is too large to send in one go. The property
+		//holds a lower bound on the size, so use it to
+		//allocate enough space (unless it's being streamed, in
+		//which case no space is needed). It's a 32 bit value, but
+		//Xlib sign extends it in to a long, so take the low 32 bits.
+		unsigned long size_hint = p.nitems && p.format == 32 ? (uint32_t)*(unsigned long*)p.data : 0;
+		LOG(LOG_INFO) << "Incremental transfer of at least " << size_hint << " bytes starting.\n";
+
+		incr_in_progress = 1;
+		incr_data.clear();
+		if(!streaming())
+			incr_data.reserve(min(size_hint, (unsigned long)max_incr_reserve));
+		free(p.data);
+
+		//Deleting the property asks for the first chunk.
+		XDeleteProperty(disp, w, property);
+		chunk_start = metric_now();
+		return false;
+	}
+
+	if(compressed)
+	{
+		bool ok = inflate_data(p.data, p.nitems * item_size(p.format));
+		free(p.data);
+		return finish_inflate(ok);
+	}
+
+	if(streaming())
+		write_out(p);
+
+	return finished(p);
+}
+
+
+//The owner has replied with a handle to the data in shared memory, or
+//refused.
+bool SelectionRequester::process_shared_reply(bool converted)
+{
+	Atom target = wanted;
+
+	if(converted)
+	{
+		Property h = read_property(disp, w, property);
+		string handle = h.type == XA_clipboard_shm && h.format == 8 ? string((char*)h.data, h.nitems) : "";
+		free(h.data);
+
+		double start = metric_now();
+		if(!handle.empty() && map_shared(handle, shared_data, shared_size))
+		{
+			record_metric(target, PHASE_READ, start, shared_size);
+			LOG(LOG_INFO) << "Mapped " << shared_size << " bytes of shared memory.\n";
+
+			requested = target;
+			Property p = {shared_data, 8, shared_size, target};
+
+			if(streaming())
+			{
+				if(!write_all(stream_fd, shared_data, shared_size))
+				{
+					LOG(LOG_ERROR) << "Writing the data failed: " << strerror(errno) << endl;
+					stream_ok = 0;
+				}
+
+				munmap(shared_data, shared_size);
+				shared_data = 0;
+				p.data = 0;
+				streamed += p.nitems;
+			}
+
+			return finished(p);
+		}
+	}
+
+	//Either the owner refused, or it's on another machine, so ask in the
+	//normal way (which may be compressed, since it's probably a long way
+	//away).
+	LOG(LOG_INFO) << "Shared memory is not available. Requesting " << GetAtomName(disp, target) << " normally.\n";
+	counting = 1;
+
+	if(fallback_compressed)
+		request_compressed(selection, target, timestamp);
+	else
+		request(selection, target, timestamp);
+
+	return false;
+}
+
+
+//Decompress some of the data, and write it out if streaming, otherwise add
+//it to incr_data. Only a small buffer's worth of decompressed data is held
+//at once when streaming. Returns false if the data is corrupt.
+bool SelectionRequester::inflate_data(const unsigned char* data, size_t len)
+{
+	unsigned char out[1 << 16];
+
+	inflater->next_in = (Bytef*)data;
+	inflater->avail_in = len;
+
+	while(!inflate_finished)
+	{
+		inflater->next_out = out;
+		inflater->avail_out = sizeof(out);
+
+		int r = inflate(inflater, Z_NO_FLUSH);
+
+		if(r != Z_OK && r != Z_STREAM_END && r != Z_BUF_ERROR)
+		{
+			LOG(LOG_ERROR) << "Decompression failed: " << (inflater->msg ? inflater->msg : "unknown error") << endl;
+			return false;
+		}
+
+		size_t n = sizeof(out) - inflater->avail_out;
+
+		if(streaming())
+		{
+			if(stream_ok && !write_all(stream_fd, out, n))
+			{
+				LOG(LOG_ERROR) << "Writing the data failed: " << strerror(errno) << endl;
+				stream_ok = 0;
+			}
+			streamed += n;
+		}
+		else
+			incr_data.insert(incr_data.end(), out, out + n);
+
+		inflate_finished = r == Z_STREAM_END;
+
+		//Stop once all the input is used up, and everything it produced
+		//has been taken.
+		if(inflater->avail_in == 0 && inflater->avail_out != 0)
+			break;
+	}
+
+	return true;
+}
+
+
+//All of the compressed data has arrived (or it was corrupt).
+bool SelectionRequester::finish_inflate(bool ok)
+{
+	unsigned long in = inflater->total_in, out = inflater->total_out;
+	inflateEnd(inflater);
+	delete inflater;
+	inflater = 0;
+
+	if(!ok || !inflate_finished)
+	{
+		LOG(LOG_ERROR) << "The compressed data is incomplete or corrupt.\n";
+		current_state = REFUSED;
+		return true;
+	}
+
+	LOG(LOG_INFO) << "Decompressed " << in << " bytes to " << out << endl;
+
+	requested = wanted;
+	Property p = {incr_data.empty() ? 0 : &incr_data[0], 8, incr_data.size(), wanted};
+
+	if(streaming())
+		p.nitems = streamed;
+
+	return finished(p);
+}
+
+
+//The next chunk of an INCR transfer has arrived.
+bool SelectionRequester::process_incr_chunk(const XEvent&)
+{
+	//Each chunk is timed from asking for it to having read it.
+	//When streaming, the chunk is written out as it's read, and then
+	//forgotten about, so only one chunk is ever in memory. Compressed
+	//chunks are decompressed first.
+	bool compressed = requested == XA_clipboard_zlib;
+	Property chunk = streaming() && !compressed ? stream_property(disp, w, property, stream_fd, stream_ok) : read_property(disp, w, property);
+	record_metric(requested, PHASE_INCR_CHUNK, chunk_start, chunk.nitems * chunk.format/8);
+
+	if(chunk.nitems == 0)
+	{
+		//The zero length chunk marks the end of the data. The data is
+		//now all in one place, so process it as if it had arrived in
+		//one go.
+		LOG(LOG_INFO) << "Incremental transfer complete: " << (streaming() ? streamed : incr_data.size()) << " bytes.\n\n";
+		free(chunk.data);
+		XDeleteProperty(disp, w, property);
+
+		incr_in_progress = 0;
+
+		if(compressed)
+			return finish_inflate(true);
+
+		//The chunks are stored as Xlib stores them, so the data is in the
+		//format of the chunks (eg a list of atoms), not just bytes.
+		int format = incr_format ? incr_format : 8;
+		Property p = {incr_data.empty() ? 0 : &incr_data[0], format, incr_data.size() / item_size(format), chunk.type};
+
+		if(streaming())
+		{
+			p.format = 8;
+			p.nitems = streamed;
+		}
+
+		return finished(p);
+	}
+
+	if(compressed)
+	{
+		bool ok = inflate_data(chunk.data, chunk.nitems * item_size(chunk.format));
+		free(chunk.data);
+
+		if(!ok)
+			return finish_inflate(false);
+	}
+	else if(streaming())
+		write_out(chunk);
+	else
+	{
+		//Every chunk should have the same format. If one doesn't, the
+		//data is garbage, so don't make it worse by mixing item sizes.
+		if(incr_format == 0)
+			incr_format = chunk.format;
+
+		if(chunk.format == incr_format)
+		{
+			unsigned char* begin = chunk.data;
+			incr_data.insert(incr_data.end(), begin, begin + chunk.nitems * item_size(chunk.format));
+		}
+		else
+			LOG(LOG_ERROR) << "Ignoring a " << chunk.format << " bit INCR chunk in a " << incr_format << " bit transfer.\n";
+
+		free(chunk.data);
+	}
+
+	//Ask for the next chunk.
+	XDeleteProperty(disp, w, property);
+	chunk_start = metric_now();
+	return false;
+}
+
+
+//All of the data for the requested target has arrived. If it's the list of
+//targets, then the best one is asked for next.
+bool SelectionRequester::finished(const Property& p)
+{
+	result = p;
+
+	if(!negotiating)
+	{
+		current_state = stream_ok ? DONE : WRITE_ERROR;
+		return true;
+	}
+
+	Atom best = pick_target_from_targets(disp, result, *preferences);
+
+	if(best == None)
+	{
+		LOG(LOG_ERROR) << "No matching datatypes.\n";
+		current_state = NO_MATCH;
+		return true;
+	}
+
+	//Request the data type we are able to select
+	LOG(LOG_DEBUG) << "Now requesting type " << GetAtomName(disp, best) << endl;
+
+	request_via(selection, best, timestamp, result);
+	return false;
+}
+
+
+
+BatchRequester::BatchRequester(Display* d, Window win, Atom prop)
+:disp(d), w(win), property(prop), selection(None), timestamp(CurrentTime), phase(IDLE), request_start(0),
+ timeouts(no_timeouts), targets(d, win, prop)
+{
+}
+
+
+BatchRequester::~BatchRequester()
+{
+	clear();
+}
+
+
+void BatchRequester::clear()
+{
+	for(unsigned int i = 0; i < fetches.size(); i++)
+		delete fetches[i];
+
+	fetches.clear();
+	wanted.clear();
+	targets.cancel();
+	phase = IDLE;
+}
+
+
+void BatchRequester::fetch(Atom s, const vector<Atom>& t, Time time)
+{
+	clear();
+	selection = s;
+	timestamp = time;
+
+	for(unsigned int i = 0; i < t.size(); i++)
+		if(result(t[i]) == 0)
+		{
+			fetches.push_back(new SelectionRequester(disp, w, t[i]));
+			fetches.back()->set_timeouts(timeouts);
+		}
+
+	//Find out what's on offer first.
+	targets.request(selection, XA_TARGETS, timestamp);
+	phase = TARGETS;
+}
+
+
+SelectionRequester::State BatchRequester::state() const
+{
+	if(phase == FINISHED)
+		return targets.state() == SelectionRequester::REFUSED ? SelectionRequester::NO_OWNER : targets.state();
+	else if(phase == IDLE)
+		return SelectionRequester::IDLE;
+	else
+		return SelectionRequester::WAITING;
+}
+
+
+const SelectionRequester* BatchRequester::result(Atom target) const
+{
+	for(unsigned int i = 0; i < fetches.size(); i++)
+		if(fetches[i]->property_name() == target)
+			return fetches[i];
+
+	return 0;
+}
+
+
+bool BatchRequester::all_finished() const
+{
+	for(unsigned int i = 0; i < wanted.size(); i++)
+		if(wanted[i]->state() == SelectionRequester::WAITING)
+			return false;
+
+	return true;
+}
+
+
+void BatchRequester::set_timeouts(const PasteTimeouts& t)
+{
+	timeouts = t;
+	targets.set_timeouts(t);
+
+	for(unsigned int i = 0; i < fetches.size(); i++)
+		fetches[i]->set_timeouts(t);
+}
+
+
+double BatchRequester::deadline() const
+{
+	double d = 0;
+
+	if(phase == TARGETS)
+		d = targets.deadline();
+	else if(phase == MULTIPLE && timeouts.convert)
+		d = request_start + timeouts.convert * 1000.;
+	else if(phase == CONVERTING)
+		for(unsigned int i = 0; i < wanted.size(); i++)
+			d = earliest(d, wanted[i]->deadline());
+
+	return d;
+}
+
+
+bool BatchRequester::check_deadline(double now)
+{
+	if(phase == TARGETS && targets.check_deadline(now))
+		return process_targets();
+	else if(phase == MULTIPLE && deadline() != 0 && now >= deadline())
+	{
+		//Falling back to separate conversions would most likely
+		//take just as long, so give up.
+		LOG(LOG_ERROR) << "Timed out waiting for MULTIPLE.\n";
+
+		for(unsigned int i = 0; i < wanted.size(); i++)
+			wanted[i]->receive(selection, wanted[i]->property_name(), false);
+
+		phase = FINISHED;
+		return true;
+	}
+	else if(phase == CONVERTING)
+	{
+		for(unsigned int i = 0; i < wanted.size(); i++)
+			wanted[i]->check_deadline(now);
+
+		if(all_finished())
+		{
+			phase = FINISHED;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+
+bool BatchRequester::handle_event(const XEvent& e)
+{
+	if(phase == TARGETS && targets.handle_event(e))
+		return process_targets();
+	else if(phase == MULTIPLE && is_reply(e, w, XA_multiple, property, timestamp))
+		return process_multiple(e);
+	else if(phase == CONVERTING)
+	{
+		for(unsigned int i = 0; i < wanted.size(); i++)
+			wanted[i]->handle_event(e);
+
+		if(all_finished())
+		{
+			phase = FINISHED;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+
+//The list of targets has arrived, so ask for everything on offer.
+bool BatchRequester::process_targets()
+{
+	if(targets.state() != SelectionRequester::DONE)
+	{
+		phase = FINISHED;
+		return true;
+	}
+
+	const Property& p = targets.data();
+	Atom* offered = (Atom*)p.data;
+	unsigned long n = (p.type == XA_ATOM || p.type == XA_TARGETS) && p.format == 32 ? p.nitems : 0;
+	bool multiple = 0;
+
+	for(unsigned long j = 0; j < n; j++)
+		if(offered[j] == XA_multiple)
+			multiple = 1;
+
+	//Targets which aren't offered are refused without asking.
+	for(unsigned int i = 0; i < fetches.size(); i++)
+	{
+		bool is_offered = 0;
+		for(unsigned long j = 0; j < n; j++)
+			if(offered[j] == fetches[i]->property_name())
+				is_offered = 1;
+
+		if(is_offered)
+			wanted.push_back(fetches[i]);
+		else
+		{
+			LOG(LOG_INFO) << GetAtomName(disp, fetches[i]->property_name()) << " is not offered.\n";
+			fetches[i]->receive(selection, fetches[i]->property_name(), false);
+		}
+	}
+
+	if(wanted.empty())
+	{
+		phase = FINISHED;
+		return true;
+	}
+
+	if(multiple && wanted.size() > 1)
+	{
+		//Each target is converted in to the property with the same name.
+		vector<Atom> pairs;
+		for(unsigned int i = 0; i < wanted.size(); i++)
+		{
+			pairs.push_back(wanted[i]->property_name());
+			pairs.push_back(wanted[i]->property_name());
+		}
+
+		LOG(LOG_DEBUG) << "Fetching " << wanted.size() << " targets with MULTIPLE.\n";
+		XChangeProperty(disp, w, property, XA_ATOM_PAIR, 32, PropModeReplace, (unsigned char*)&pairs[0], pairs.size());
+		XConvertSelection(disp, selection, XA_multiple, property, w, timestamp);
+		request_start = metric_now();
+		phase = MULTIPLE;
+	}
+	else
+		request_all();
+
+	return false;
+}
+
+
+//Ask for every target separately. All of the requests are sent together,
+//and the replies can arrive in any order.
+void BatchRequester::request_all()
+{
+	LOG(LOG_DEBUG) << "Fetching " << wanted.size() << " targets with pipelined conversions.\n";
+
+	for(unsigned int i = 0; i < wanted.size(); i++)
+		wanted[i]->request(selection, wanted[i]->property_name(), timestamp);
+
+	phase = CONVERTING;
+}
+
+
+//The reply to MULTIPLE has arrived. Every pair which the owner could not
+//convert has had its property replaced with None.
+bool BatchRequester::process_multiple(const XEvent& e)
+{
+	total_round_trips++;
+	record_metric(XA_multiple, PHASE_CONVERT, request_start);
+
+	if(e.xselection.property == None)
+	{
+		//The owner offered MULTIPLE, but won't do it, so ask for
+		//everything the other way instead.
+		LOG(LOG_INFO) << "MULTIPLE refused. Falling back to separate conversions.\n";
+		request_all();
+		return false;
+	}
+
+	Property p = read_property(disp, w, property);
+	Atom* pairs = (Atom*)p.data;
+	unsigned long n = (p.type == XA_ATOM_PAIR || p.type == XA_ATOM) && p.format == 32 ? p.nitems : 0;
+
+	phase = CONVERTING;
+
+	for(unsigned int i = 0; i < wanted.size(); i++)
+	{
+		Atom target = wanted[i]->property_name();
+		bool converted = 0;
+
+		for(unsigned long j = 0; j + 1 < n; j += 2)
+			if(pairs[j] == target && pairs[j+1] != None)
+				converted = 1;
+
+		wanted[i]->receive(selection, target, converted);
+	}
+
+	free(p.data);
+
+	if(all_finished())
+	{
+		phase = FINISHED;
+		return true;
+	}
+
+	return false;
+}
+
+
+
+SpeculativeRequester::SpeculativeRequester(Display* d, Window win, Atom prop)
+:disp(d), w(win), selection(None), timestamp(CurrentTime), preferences(0), stream_fd(-1), timeouts(no_timeouts), share(0), compress(0), phase(IDLE), replies(0),
+ targets(d, win, prop), guesser(0), winner(&targets), final_state(SelectionRequester::IDLE)
+{
+}
+
+
+SpeculativeRequester::~SpeculativeRequester()
+{
+	delete guesser;
+}
+
+
+void SpeculativeRequester::paste(Atom s, TargetPreferences& p, Atom guess, Time t)
+{
+	cancel();
+	selection = s;
+	timestamp = t;
+	preferences = &p;
+	winner = &targets;
+
+	if(guess == None)
+	{
+		targets.count_replies(1);
+		targets.stream_to(stream_fd);
+		targets.paste(selection, *preferences, timestamp);
+		phase = NEGOTIATING;
+		return;
+	}
+
+	if(guesser == 0 || guesser->property_name() != guess)
+	{
+		delete guesser;
+		guesser = new SelectionRequester(disp, w, guess);
+		guesser->set_timeouts(timeouts);
+	}
+
+	guesser->count_replies(0);
+	guesser->use_shared_memory(share);
+	guesser->use_compression(compress);
+
+	//Both requests go out together, so they cost one round trip, which is
+	//counted when the first of them finishes. TARGETS is never written
+	//out.
+	LOG(LOG_DEBUG) << "Guessing " << GetAtomName(disp, guess) << endl;
+	targets.count_replies(0);
+	targets.stream_to(-1);
+	targets.request(selection, XA_TARGETS, timestamp);
+	guesser->stream_to(stream_fd);
+	guesser->request_preferred(selection, guess, timestamp);
+	replies = 0;
+	phase = RACING;
+}
+
+
+void SpeculativeRequester::cancel()
+{
+	targets.cancel();
+	if(guesser)
+		guesser->cancel();
+
+	phase = IDLE;
+}
+
+
+void SpeculativeRequester::use_shared_memory(bool use)
+{
+	share = use;
+	targets.use_shared_memory(use);
+}
+
+
+void SpeculativeRequester::use_compression(bool use)
+{
+	compress = use;
+	targets.use_compression(use);
+}
+
+
+void SpeculativeRequester::stream_to(int fd)
+{
+	stream_fd = fd;
+}
+
+
+SelectionRequester::State SpeculativeRequester::state() const
+{
+	if(phase == FINISHED)
+		return final_state;
+	else if(phase == IDLE)
+		return SelectionRequester::IDLE;
+	else
+		return SelectionRequester::WAITING;
+}
+
+
+void SpeculativeRequester::set_timeouts(const PasteTimeouts& t)
+{
+	timeouts = t;
+	targets.set_timeouts(t);
+
+	if(guesser)
+		guesser->set_timeouts(t);
+}
+
+
+double SpeculativeRequester::deadline() const
+{
+	if(phase == NEGOTIATING || phase == FALLBACK)
+		return targets.deadline();
+	else if(phase == RACING)
+		return earliest(targets.deadline(), guesser->deadline());
+	else if(phase == DRAINING)
+		return guesser->deadline();
+	else
+		return 0;
+}
+
+
+bool SpeculativeRequester::check_deadline(double now)
+{
+	if(phase == NEGOTIATING || phase == FALLBACK)
+	{
+		if(targets.check_deadline(now))
+			return finish(targets, targets.state());
+	}
+	else if(phase == RACING)
+	{
+		//A guess which times out is as good as refused.
+		bool targets_expired = targets.check_deadline(now);
+		bool guess_expired = guesser->check_deadline(now);
+
+		if(targets_expired || guess_expired)
+			return process_race();
+	}
+	else if(phase == DRAINING)
+	{
+		if(guesser->check_deadline(now))
+			return fall_back();
+	}
+
+	return false;
+}
+
+
+bool SpeculativeRequester::handle_event(const XEvent& e)
+{
+	if(phase == NEGOTIATING || phase == FALLBACK)
+	{
+		if(targets.handle_event(e))
+			return finish(targets, targets.state());
+	}
+	else if(phase == RACING)
+	{
+		bool targets_arrived = targets.handle_event(e);
+		bool guess_arrived = guesser->handle_event(e);
+
+		if(targets_arrived || guess_arrived)
+		{
+			if(++replies == 1)
+				total_round_trips++;
+
+			return process_race();
+		}
+	}
+	else if(phase == DRAINING)
+	{
+		//Whatever the reply says, the guess isn't wanted any more.
+		if(is_reply(e, w, guesser->target(), guesser->property_name(), timestamp))
+			return fall_back();
+	}
+
+	return false;
+}
+
+
+//One of the replies has arrived. Decide whether there's an answer yet.
+bool SpeculativeRequester::process_race()
+{
+	SelectionRequester::State guess_state = guesser->state();
+
+	if(guess_state == SelectionRequester::DONE || guess_state == SelectionRequester::WRITE_ERROR)
+	{
+		//The guess was right, so TARGETS isn't needed.
+		LOG(LOG_INFO) << "Guessed the target correctly.\n";
+		targets.cancel();
+		return finish(*guesser, guess_state);
+	}
+
+	//Once some of the guess has been written out, it can't be taken back,
+	//and writing another target after it would corrupt the output. So the
+	//guess has to be seen through, and if it fails, the paste fails.
+	if(guesser->written() > 0)
+	{
+		if(guess_state == SelectionRequester::WAITING)
+			return false;
+
+		LOG(LOG_ERROR) << "The guess failed part way through, after some of it was written out.\n";
+		targets.cancel();
+		return finish(*guesser, guess_state);
+	}
+
+	if(targets.state() == SelectionRequester::WAITING)
+		return false;
+
+	if(targets.state() != SelectionRequester::DONE)
+	{
+		//TARGETS was refused, which means that nothing owns the
+		//selection, unless the owner is too broken to do TARGETS but
+		//can still convert the guess.
+		if(guess_state == SelectionRequester::WAITING)
+			return false;
+
+		if(targets.state() == SelectionRequester::TIMED_OUT)
+			return finish(targets, SelectionRequester::TIMED_OUT);
+
+		return finish(targets, SelectionRequester::NO_OWNER);
+	}
+
+	//TARGETS has arrived. If the guess is on offer, it's worth waiting for,
+	//otherwise the owner is certain to refuse it.
+	if(guess_state == SelectionRequester::WAITING && guess_offered())
+		return false;
+
+	//If the wrong guess was asked for through shared memory or
+	//compression, its refusal can't be told apart from the reply to asking
+	//for the best target the same way, so wait for it first.
+	if(guess_state == SelectionRequester::WAITING && guess_clashes())
+	{
+		LOG(LOG_DEBUG) << "Waiting for the reply to the wrong guess.\n";
+		phase = DRAINING;
+		return false;
+	}
+
+	return fall_back();
+}
+
+
+bool SpeculativeRequester::guess_offered() const
+{
+	return offers(targets.data(), guesser->property_name());
+}
+
+
+//Whether the guess is waiting for a private target which the owner offers,
+//and which the best target might therefore be asked for through as well.
+bool SpeculativeRequester::guess_clashes() const
+{
+	Atom t = guesser->target();
+	return (t == XA_clipboard_shm || t == XA_clipboard_zlib) && offers(targets.data(), t);
+}
+
+
+//The guess was wrong, so pick the best of the rest from TARGETS, and ask for
+//that instead.
+bool SpeculativeRequester::fall_back()
+{
+	Atom guess = guesser->property_name();
+	guesser->cancel();
+
+	Atom best = pick_target_from_targets(disp, targets.data(), *preferences, guess);
+
+	if(best == None)
+	{
+		LOG(LOG_ERROR) << "No matching datatypes.\n";
+		return finish(targets, SelectionRequester::NO_MATCH);
+	}
+
+	LOG(LOG_INFO) << "Guessed wrong. Now requesting type " << GetAtomName(disp, best) << endl;
+	targets.count_replies(1);
+	targets.stream_to(stream_fd);
+
+	targets.request_via(selection, best, timestamp, targets.data());
+
+	phase = FALLBACK;
+	return false;
+}
+
+
+bool SpeculativeRequester::finish(const SelectionRequester& r, SelectionRequester::State s)
+{
+	winner = &r;
+	final_state = s;
+	phase = FINISHED;
+	return true;
+}
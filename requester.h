@@ -0,0 +1,393 @@
+#ifndef X_CLIPBOARD_REQUESTER_H
+#define X_CLIPBOARD_REQUESTER_H
+
+#include <X11/Xlib.h>
+#include <vector>
+#include "preferences.h"
+#include "util.h"
+
+struct z_stream_s;
+
+//A local copy of a property. The data is allocated with malloc(), so
+//it must be released with free(). As with XGetWindowProperty, 32 bit
+//items are stored as longs, so an atom list can be used directly.
+struct Property
+{
+	unsigned char *data;
+	int format;
+	unsigned long nitems;
+	Atom type;
+};
+
+
+//The number of round trips to the server (including conversions, which are
+//round trips via the owner of the selection), so the cost of a paste can be
+//measured.
+extern unsigned long total_round_trips;
+
+
+//Fetch all the data from a property, however large it is.
+Property read_property(Display* disp, Window w, Atom property);
+
+//As read_property, but 8 bit data is written to fd as it arrives rather than
+//being kept, in which case data is 0 and nitems is the number of bytes
+//written. Anything else (eg INCR) is read as normal. ok is cleared if
+//writing fails.
+Property stream_property(Display* disp, Window w, Atom property, int fd, bool& ok);
+
+//Xlib holds 32 bit items in longs, which may be bigger than 4 bytes. This
+//gives the data as it was sent, with each 32 bit item packed in to 4 bytes
+//(in buf, if they need packing), so that nitems * format / 8 bytes can be
+//written out.
+const unsigned char* wire_data(const Property& p, std::vector<unsigned char>& buf);
+
+//Pick the best target from a list of targets which can be converted to,
+//according to the preferences, ignoring except. Returns None if nothing is
+//acceptable.
+Atom pick_target_from_list(Display* disp, const Atom* atom_list, int nitems, TargetPreferences& preferences, Atom except = None);
+
+//Finds the best target given up to three atoms provided (any can be None).
+//Useful for part of the Xdnd protocol.
+Atom pick_target_from_atoms(Display* disp, Atom t1, Atom t2, Atom t3, TargetPreferences& preferences);
+
+//Finds the best target given a local copy of a TARGETS property.
+Atom pick_target_from_targets(Display* disp, const Property& p, TargetPreferences& preferences, Atom except = None);
+
+
+//The requesting side of a paste. It asks the owner of a selection for the
+//data, either in a particular target, or in the best target offered (which
+//means asking for TARGETS first). The data arrives in the given property on
+//window w, which must have PropertyChangeMask selected so that INCR
+//transfers work.
+//
+//As with SelectionOwner, nothing waits for events: the caller hands every
+//event to handle_event, which returns true once the paste has finished,
+//successfully or otherwise.
+class SelectionRequester
+{
+	public:
+		enum State
+		{
+			IDLE,       //Nothing has been asked for
+			WAITING,    //Waiting for the owner
+			DONE,       //The data has arrived
+			REFUSED,    //The owner refused the conversion
+			NO_OWNER,   //TARGETS was refused, so probably nothing owns the selection
+			NO_MATCH,   //None of the targets offered is acceptable
+			WRITE_ERROR,//The data could not be streamed out
+			TIMED_OUT   //The owner took too long
+		};
+
+		SelectionRequester(Display* disp, Window w, Atom property);
+		~SelectionRequester();
+
+		//Ask for TARGETS, and then for the best target offered according
+		//to the preferences, which must last until the paste has
+		//finished. Anything in progress is abandoned.
+		void paste(Atom selection, TargetPreferences& preferences, Time t);
+
+		//Ask for a single target. Anything in progress is abandoned.
+		void request(Atom selection, Atom target, Time t);
+
+		//As request, but through shared memory (see shared.h), which the
+		//owner must offer. If the owner refuses, or isn't on this
+		//machine, the target is then asked for in the normal way.
+		void request_shared(Atom selection, Atom target, Time t);
+
+		//As request, but compressed (with _X_CLIPBOARD_ZLIB), which the
+		//owner must offer. The data is decompressed as it arrives. If the
+		//owner refuses, the target is asked for in the normal way.
+		void request_compressed(Atom selection, Atom target, Time t);
+
+		//Ask for a target in the best way that the owner offers,
+		//according to use_shared_memory and use_compression. offered is
+		//the owner's TARGETS.
+		void request_via(Atom selection, Atom target, Time t, const Property& offered);
+
+		//As request_via, but before TARGETS is known: shared memory or
+		//compression is asked for according to use_shared_memory and
+		//use_compression on the chance that the owner offers it, falling
+		//back in the same way if it doesn't.
+		void request_preferred(Atom selection, Atom target, Time t);
+
+		//When paste() picks a target, ask for it through shared memory if
+		//the owner offers _X_CLIPBOARD_SHM.
+		void use_shared_memory(bool use) { share = use; }
+
+		//When paste() picks a target, ask for it compressed if the owner
+		//offers _X_CLIPBOARD_ZLIB (and shared memory isn't used).
+		void use_compression(bool use) { compress = use; }
+
+		//Abandon whatever is in progress.
+		void cancel();
+
+		//Rather than keeping the data, write it to fd as each chunk
+		//arrives, so that memory use stays bounded however much there is,
+		//and whatever is reading fd can start straight away. Once the
+		//paste is DONE, data() is empty, but size() still gives the amount.
+		//TARGETS, when it's fetched by paste(), is not written out.
+		void stream_to(int fd) { stream_fd = fd; }
+
+		//Give up if the owner takes too long. Nothing times out by
+		//default.
+		void set_timeouts(const PasteTimeouts& t) { timeouts = t; }
+
+		//Whether the reply to a conversion counts as a round trip in
+		//total_round_trips. It shouldn't when several requests are sent
+		//together and their replies waited for together, in which case
+		//whoever sent them counts the round trip instead. On by default.
+		void count_replies(bool count) { counting = count; }
+
+		//When the current phase times out (on the metric_now clock), or 0
+		//if it never does. The event loop should wait no longer than this,
+		//and then call check_deadline, which returns true if the paste
+		//has finished because it timed out.
+		double deadline() const;
+		bool check_deadline(double now);
+
+		//Handle a conversion which was asked for some other way, eg as
+		//part of a MULTIPLE request. If it was converted, the data is in
+		//the property, otherwise it was refused. Returns true if the paste
+		//has finished, which it hasn't if the data is arriving with INCR.
+		bool receive(Atom selection, Atom target, bool converted);
+
+		//Returns true if this event finished the paste.
+		bool handle_event(const XEvent& e);
+
+		State state() const { return current_state; }
+
+		//Once the state is DONE, the target which was pasted and the data.
+		//The data remains valid until the next request.
+		Atom target() const { return requested; }
+
+		//The property the data arrives in.
+		Atom property_name() const { return property; }
+		const Property& data() const { return result; }
+		size_t size() const { return result.nitems * result.format / 8; }
+
+		//How much has been written out by stream_to since the last
+		//request, even if the paste then failed (eg timed out part way
+		//through an INCR transfer), so that the output is incomplete.
+		unsigned long written() const { return streamed; }
+
+	private:
+		SelectionRequester(const SelectionRequester&);
+		void operator=(const SelectionRequester&);
+
+		bool process_selection_notify(const XEvent& e);
+		bool process_reply(bool converted);
+		bool process_incr_chunk(const XEvent& e);
+		bool process_shared_reply(bool converted);
+		bool inflate_data(const unsigned char* data, size_t len);
+		bool finish_inflate(bool ok);
+		bool finished(const Property& p);
+		void clear();
+		bool streaming() const { return stream_fd >= 0 && !negotiating; }
+		void write_out(Property& p);
+
+		Display* disp;
+		Window w;
+		Atom property;
+
+		Atom selection;
+		Atom requested;
+		Time timestamp;
+		bool negotiating;                   //TARGETS is being fetched for paste()
+		TargetPreferences* preferences;
+		State current_state;
+
+		//The data, once it has all arrived. If it came in one go, then
+		//it's owned by result, otherwise it lives in incr_data.
+		Property result;
+
+		//State of an incremental transfer. The chunks are appended to
+		//incr_data (as Xlib stores them) until the zero length chunk
+		//arrives.
+		bool incr_in_progress;
+		std::vector<unsigned char> incr_data;
+		int incr_format;                    //The format of the chunks, or 0 before the first
+
+		//Where to stream the data, or -1, and whether it's going well.
+		int stream_fd;
+		bool stream_ok;
+		unsigned long streamed;             //Bytes written so far
+
+		double request_start;               //When XConvertSelection was sent.
+		double chunk_start;                 //When the last INCR chunk was asked for.
+		PasteTimeouts timeouts;
+		bool counting;                      //See count_replies
+
+		//The target wanted from _X_CLIPBOARD_SHM or _X_CLIPBOARD_ZLIB.
+		Atom wanted;
+
+		//Shared memory. The data is mapped rather than copied.
+		bool share;
+		unsigned char* shared_data;
+		size_t shared_size;
+
+		//Compression. The decompressed data goes wherever the data would
+		//have gone (incr_data, or stream_fd).
+		bool compress;
+		bool fallback_compressed;           //Ask for it compressed if shared memory fails
+		z_stream_s* inflater;
+		bool inflate_finished;
+};
+
+
+//Fetch several targets from a selection in one go, rather than running a
+//paste for each one, which repeats the TARGETS round trip and risks the
+//selection changing in between. TARGETS is fetched first, to find out which
+//of the targets are offered, and whether the owner supports MULTIPLE. If it
+//does, then everything is asked for with a single MULTIPLE request (and a
+//single round trip via the owner). Otherwise, all of the conversions are
+//sent at once, without waiting for each reply before sending the next. Each
+//target is fetched in to a property named after the target, so that the
+//replies can't get mixed up.
+//
+//As with SelectionRequester, events are handed to handle_event, which
+//returns true when everything has arrived (or been refused).
+class BatchRequester
+{
+	public:
+		BatchRequester(Display* disp, Window w, Atom property);
+		~BatchRequester();
+
+		//Fetch the targets. Duplicates are ignored.
+		void fetch(Atom selection, const std::vector<Atom>& targets, Time t);
+
+		//As for SelectionRequester. Targets which time out are not
+		//fetched, and if TARGETS times out, nothing is.
+		void set_timeouts(const PasteTimeouts& t);
+		double deadline() const;
+		bool check_deadline(double now);
+
+		bool handle_event(const XEvent& e);
+
+		//NO_OWNER if TARGETS was refused, otherwise DONE when finished.
+		SelectionRequester::State state() const;
+
+		//The result for each target. It's in the DONE state if it was
+		//fetched. Returns 0 for targets which were not asked for.
+		const SelectionRequester* result(Atom target) const;
+
+	private:
+		BatchRequester(const BatchRequester&);
+		void operator=(const BatchRequester&);
+
+		void clear();
+		bool process_targets();
+		bool process_multiple(const XEvent& e);
+		void request_all();
+		bool all_finished() const;
+
+		Display* disp;
+		Window w;
+		Atom property;
+		Atom selection;
+		Time timestamp;
+
+		enum Phase
+		{
+			IDLE,
+			TARGETS,
+			MULTIPLE,
+			CONVERTING,
+			FINISHED
+		};
+		Phase phase;
+		double request_start;
+		PasteTimeouts timeouts;
+
+		//Fetches TARGETS.
+		SelectionRequester targets;
+
+		//One requester per target, fetching in to a property named after
+		//the target.
+		std::vector<SelectionRequester*> fetches;
+
+		//The targets which are offered, and so are being fetched.
+		std::vector<SelectionRequester*> wanted;
+};
+
+
+//A paste which guesses. Normally the data costs two round trips via the
+//owner: one for TARGETS, and then one for the best target. But most of the
+//time, the best target is simply the one we'd prefer most, so that is asked
+//for at the same time as TARGETS (in a different property), and both
+//replies arrive after a single round trip. If the guess was right, then
+//TARGETS is not needed at all. If it was wrong, then TARGETS has usually
+//already arrived, and the best target offered is asked for as normal.
+//
+//Without a guess, this is just SelectionRequester::paste.
+class SpeculativeRequester
+{
+	public:
+		SpeculativeRequester(Display* disp, Window w, Atom property);
+		~SpeculativeRequester();
+
+		//As SelectionRequester::paste, but if guess is not None, then it
+		//is asked for straight away, in the property named after it.
+		void paste(Atom selection, TargetPreferences& preferences, Atom guess, Time t);
+
+		void cancel();
+		void stream_to(int fd);
+		void set_timeouts(const PasteTimeouts& t);
+
+		//As for SelectionRequester. The guess is asked for the same way
+		//with request_preferred, since TARGETS hasn't arrived yet, so if
+		//the owner doesn't offer it, that costs another round trip.
+		void use_shared_memory(bool use);
+		void use_compression(bool use);
+		double deadline() const;
+		bool check_deadline(double now);
+		bool handle_event(const XEvent& e);
+
+		SelectionRequester::State state() const;
+
+		//Once the paste has finished, whichever request produced the
+		//answer.
+		const SelectionRequester& result() const { return *winner; }
+
+	private:
+		SpeculativeRequester(const SpeculativeRequester&);
+		void operator=(const SpeculativeRequester&);
+
+		bool process_race();
+		bool fall_back();
+		bool guess_offered() const;
+		bool guess_clashes() const;
+		bool finish(const SelectionRequester& r, SelectionRequester::State s);
+
+		Display* disp;
+		Window w;
+		Atom selection;
+		Time timestamp;
+		TargetPreferences* preferences;
+		int stream_fd;
+		PasteTimeouts timeouts;
+		bool share;
+		bool compress;
+
+		enum Phase
+		{
+			IDLE,
+			NEGOTIATING, //No guess, so it's an ordinary paste
+			RACING,      //Waiting for TARGETS and the guess
+			DRAINING,    //The guess was wrong, but its reply is still to come
+			FALLBACK,    //The guess was wrong, so fetching the best target
+			FINISHED
+		};
+		Phase phase;
+		int replies;                        //Replies which arrived while RACING, which cost one round trip
+
+		//Fetches TARGETS, and then the best target if the guess was wrong.
+		SelectionRequester targets;
+
+		//Fetches the guess, in to a property named after it.
+		SelectionRequester* guesser;
+
+		const SelectionRequester* winner;
+		SelectionRequester::State final_state;
+};
+
+#endif
@@ -1,244 +1,167 @@
 #include <X11/Xlib.h>
 #include <X11/Xatom.h>
-#include <X11/cursorfont.h>
 #include <iostream>
-#include <sstream>
-#include <fstream>
 #include <string>
-#include <map>
 #include <vector>
-#include <cstdio>
-#include <cstring>
+#include <climits>
 #include <cstdlib>
 #include <unistd.h>
+#include "xclipboard.h"
 using namespace std;
 
 //See paste.cc for a description of how the copy/paste and XDnD state machine works.
 
-//See process_selection_request to see how to perform a paste when a SelectionNotify
-//event arrives.
-
-//see main for a sample implementation of an Xdnd state machine.
-
-
-//Define atome not defined in Xatom.h
-
-Atom XA_TARGETS;
-Atom XA_multiple;
-Atom XA_image_bmp;
-Atom XA_image_jpg;
-Atom XA_image_tiff;
-Atom XA_image_png;
-Atom XA_text_uri_list;
-Atom XA_text_uri;
-Atom XA_text_plain;
-Atom XA_text;
-
-Atom XA_XdndSelection;
-Atom XA_XdndAware;
-Atom XA_XdndEnter;
-Atom XA_XdndLeave;
-Atom XA_XdndTypeList;
-Atom XA_XdndPosition;
-Atom XA_XdndActionCopy;
-Atom XA_XdndStatus;
-Atom XA_XdndDrop;
-Atom XA_XdndFinished;
-
-//The three states of Xdnd: we're over a window which does not
-//know about XDnD, we're over a window which does know, but won't
-//allow a drop (because we offer no suitable datatype), or we're
-//over a window which will accept a drop.
-#define UNAWARE 0
-#define UNRECEPTIVE 1
-#define CAN_DROP 2
-
-//Utility function for getting the atom name as a string.
-string GetAtomName(Display* disp, Atom a)
-{
-	if(a == None)
-		return "None";
-	else
-		return XGetAtomName(disp, a);
-}
-
+//All of the work of owning a selection and dragging is done by
+//SelectionOwner (owner.cc) and DndSource (dnd.cc). This program supplies the
+//data, and runs the event loop.
 
-//A simple, inefficient function for reading a
-//whole file in to memory
-string read_whole_file(const string& name, string& fullname)
-{
-	ostringstream f;
-	ifstream file;
 
-	//Try in the current directory first, then in the data directory
-	{
-		vector<char> buf(4096, 0);
-		getcwd(&buf[0], 4095);
-		fullname = &buf[0] + string("/") + name;
-	}
+//The most memory to use for holding converted images.
+const size_t conversion_cache_size = 64 << 20;
 
-	file.open(fullname.c_str(), ios::binary);
 
-	if(!file.good())
-	{
-		fullname = DATADIR + name;
-		file.open(fullname.c_str(), ios::binary);
-	}
-
-	f << file.rdbuf();
+//Make a filename absolute, so that it can be used in a URL.
+string absolute_path(const string& name)
+{
+	if(!name.empty() && name[0] == '/')
+		return name;
 
-	return f.str();
+	vector<char> buf(4096, 0);
+	getcwd(&buf[0], 4095);
+	return &buf[0] + string("/") + name;
 }
 
 
-//Construct a list of targets and place them in the specified property This
-//consists of all datatypes we know of as well as TARGETS and MULTIPLE. Reading
-//this property tell the application wishing to paste which datatypes we offer.
-void set_targets_property(Display* disp, Window w, map<Atom, string>& typed_data, Atom property)
+//Find a data file, looking in the current directory first, then in the data
+//directory. The file is not read: that happens when the data is first asked
+//for.
+string find_data_file(const string& name)
 {
+	string fullname = absolute_path(name);
 
-	vector<Atom> targets; targets.push_back(XA_TARGETS);
-	targets.push_back(XA_multiple);
+	if(access(fullname.c_str(), R_OK) != 0)
+		fullname = DATADIR + name;
 
+	return fullname;
+}
 
-	for(map<Atom,string>::const_iterator i=typed_data.begin(); i != typed_data.end(); i++)
-		targets.push_back(i->first);
 
+//Set the image being offered, and its URL.
+void set_image(ConversionEngine& typed_data, const string& image)
+{
+	if(!typed_data.set_source(image))
+		LOG(LOG_ERROR) << "Unknown image type: " << image << endl;
 
-	cout << "Offering: ";
-	for(unsigned int i = 0; i < targets.size(); i++)
-		cout << GetAtomName(disp, targets[i]) << "  ";
-	cout << endl;
+	string url = "file://" + image;
 
-	//Fill up this property with a list of targets.
-	XChangeProperty(disp, w, property, XA_ATOM, 32, PropModeReplace,
-					(unsigned char*)&targets[0], targets.size());
+	typed_data.add(XA_text_uri_list, Payload(url));
+	typed_data.add(XA_text_uri, Payload(url));
+	typed_data.add(XA_text_plain, Payload(url));
+	typed_data.add(XA_text, Payload(url));
+	typed_data.add(XA_STRING, Payload(url));
 }
 
 
+//In daemon mode, selection keeps running when it loses the selection, so
+//that new data can be copied without starting a new process (and interning
+//the atoms, etc) every time. The daemon announces itself by putting its
+//window in the _X_CLIPBOARD_DAEMON property on the root window (and on its
+//own window, so that a stale property left by a daemon which has died can be
+//detected, as with XdndProxy). New data is pushed by writing the name of the
+//image in to the _X_CLIPBOARD_PUSH property on the daemon's window. The type
+//of the property is the selection to take ownership of.
 
-//This function essentially performs the paste operation: by converting the
-//stored data in to a format acceptable to the destination and replying
-//with an acknowledgement.
-void process_selection_request(XEvent e, map<Atom, string>& typed_data)
+//Find the running daemon, if there is one.
+Window find_daemon(Display* disp, Window root)
 {
+	Window daemon = None;
+	Atom type;
+	int format;
+	unsigned long nitems, bytes_after;
+	unsigned char* data = 0;
 
-	if(e.type != SelectionRequest)
-		return;
-
-	//Extract the relavent data
-	Window owner     = e.xselectionrequest.owner;
-	Atom selection   = e.xselectionrequest.selection;
-	Atom target      = e.xselectionrequest.target;
-	Atom property    = e.xselectionrequest.property;
-	Window requestor = e.xselectionrequest.requestor;
-	Time timestamp   = e.xselectionrequest.time;
-	Display* disp    = e.xselection.display;
-
-	cout << "A selection request has arrived!\n";
-	cout << hex << "Owner = 0x" << owner << endl;
-	cout << "Selection atom = " << GetAtomName(disp, selection) << endl;
-	cout << "Target atom    = " << GetAtomName(disp, target)    << endl;
-	cout << "Property atom  = " << GetAtomName(disp, property) << endl;
-	cout << hex << "Requestor = 0x" << requestor << dec << endl;
-	cout << "Timestamp = " << timestamp << endl;
-
-
-	//X should only send requests for the selections since we own.
-	//since we own exaclty one, we don't need to check it.
-
-	//Replies to the application requesting a pasting are XEvenst
-	//sent via XSendEvent
-	XEvent s;
-
-	//Start by constructing a refusal request.
-	s.xselection.type      = SelectionNotify;
-	//s.xselection.serial     - filled in by server
-	//s.xselection.send_event - filled in by server
-	//s.xselection.display    - filled in by server
-	s.xselection.requestor = requestor;
-	s.xselection.selection = selection;
-	s.xselection.target    = target;
-	s.xselection.property  = None;   //This means refusal
-	s.xselection.time      = timestamp;
-
-
-
-	if(target ==XA_TARGETS)
+	if(XGetWindowProperty(disp, root, XA_clipboard_daemon, 0, 1, False, XA_WINDOW, &type, &format, &nitems, &bytes_after, &data) == Success && data)
 	{
-		cout << "Replying with a target list.\n";
-		set_targets_property(disp, requestor, typed_data, property);
-		s.xselection.property = property;
+		if(type == XA_WINDOW && format == 32 && nitems == 1)
+			daemon = *(Window*)data;
+		XFree(data);
 	}
-	else if(typed_data.count(target))
-	{
-		//We're asked to convert to one of the formats we know about
-		cout << "Replying with which ever data I have" << endl;
 
-		//Fill up the property with the URI.
-		s.xselection.property = property;
-		XChangeProperty(disp, requestor, property, target, 8, PropModeReplace,
-						reinterpret_cast<const unsigned char*>(typed_data[target].c_str()), typed_data[target].size());
-	}
-	else if(target == XA_multiple)
-	{
-		//In this case, the property has been filled up with a list
-		//of atom pairs. The pairs being (target, property). The
-		//processing should continue as if whole bunch of
-		//SelectionRequest events had been received with the
-		//targets and properties specified.
-
-		//The ICCCM is rather ambiguous and confusing on this particular point,
-		//and I've never encountered a program which requests this (I can't
-		//test it), so I haven't implemented it.
-
-		cout << "MULTIPLE is not implemented. It should be, according to the ICCCM, but\n"
-			 << "I've never encountered it, so I can't test it.\n";
-	}
-	else
+	if(daemon == None)
+		return None;
+
+	//If the daemon has gone away, then its window has been destroyed, and
+	//reading from it is an error. Such errors must not be fatal.
+	Window check = None;
+	int (*old_handler)(Display*, XErrorEvent*) = XSetErrorHandler(ignore_x_error);
+	data = 0;
+
+	if(XGetWindowProperty(disp, daemon, XA_clipboard_daemon, 0, 1, False, XA_WINDOW, &type, &format, &nitems, &bytes_after, &data) == Success && data)
 	{
-		//We've been asked to convert to something we don't know
-		//about.
-		cout << "No valid conversion. Replying with refusal.\n";
+		if(type == XA_WINDOW && format == 32 && nitems == 1)
+			check = *(Window*)data;
+		XFree(data);
 	}
 
-	//Reply
-	XSendEvent(disp, e.xselectionrequest.requestor, True, 0, &s);
-	cout << endl;
+	XSync(disp, False);
+	XSetErrorHandler(old_handler);
+
+	return check == daemon ? daemon : None;
 }
 
 
-//Find the applications top level window under the mouse.
-Window find_app_window(Display* disp, Window w)
+//Handle a push of new data. The property is read and deleted, and then we
+//take ownership of the selection. The timestamp of the property change is
+//used for the ownership, as the ICCCM requires a real timestamp.
+void process_push(XEvent e, ConversionEngine& typed_data, SelectionOwner& owner)
 {
-	//Drill down the windows under the mouse, looking for
-	//the window with the XdndAware property.
+	if(e.type != PropertyNotify || e.xproperty.atom != XA_clipboard_push || e.xproperty.state != PropertyNewValue)
+		return;
 
-	int nprops, i = 0;
-	Atom* a;
+	Display* disp = e.xproperty.display;
+	Window w = e.xproperty.window;
 
-	if(w == 0)
-		return 0;
+	Atom type;
+	int format;
+	unsigned long nitems, bytes_after;
+	unsigned char* data = 0;
 
-	//Search for the WM_STATE property
-	a = XListProperties(disp, w, &nprops);
-	for(i = 0; i < nprops; i++)
-		if(a[i] == XA_XdndAware)
-			break;
+	if(XGetWindowProperty(disp, w, XA_clipboard_push, 0, LONG_MAX/4, True, AnyPropertyType, &type, &format, &nitems, &bytes_after, &data) != Success || data == 0)
+		return;
 
-	if(nprops)
-		XFree(a);
+	string image((char*)data, nitems);
+	XFree(data);
 
-	if(i != nprops)
-		return w;
+	if(type == None || format != 8)
+		return;
 
-	//Drill down one more level.
-	Window child, wtmp;
-	int tmp;
-	unsigned int utmp;
-	XQueryPointer(disp, w, &wtmp, &child, &tmp, &tmp, &tmp, &tmp, &utmp);
+	LOG(LOG_INFO) << "New image pushed: " << image << " for selection " << GetAtomName(disp, type) << endl;
 
-	return find_app_window(disp, child);
+	//Taking the selection with data we can't supply would throw away
+	//whatever the current owner (maybe us) has, so keep things as they are.
+	if(!ConversionEngine::usable_source(image))
+	{
+		LOG(LOG_ERROR) << "Can't read " << image << " or don't know its type. Ignoring the push.\n";
+		return;
+	}
+
+	set_image(typed_data, image);
+	owner.own(type, e.xproperty.time);
+
+	LOG(LOG_DEBUG) << endl;
+}
+
+
+//When the event loop next needs to check on things, even if nothing
+//happens.
+double next_deadline(const SelectionOwner& owner, const DndSource& drag)
+{
+	double d = owner.deadline();
+
+	if(drag.deadline() != 0)
+		d = min(d, drag.deadline());
+
+	return d;
 }
 
 
@@ -252,8 +175,14 @@ int main(int argc, char**argv)
 	int screen;
 	XEvent e;
 
+	init_log_level();
+
 	//Standard X init stuff
 	disp = XOpenDisplay(NULL);
+
+	//Requestors can destroy their windows at any time, which would make
+	//our requests to them fail. This must not kill us.
+	XSetErrorHandler(report_x_error);
 	screen = DefaultScreen(disp);
 	root = RootWindow(disp, screen);
 
@@ -262,72 +191,116 @@ int main(int argc, char**argv)
 	w = XCreateSimpleWindow(disp, root, 0, 0, 100, 100, 0, BlackPixel(disp, screen), BlackPixel(disp, screen));
 
 
-	cerr << "Created window: 0x" << hex <<  w << dec << endl << endl;
+	LOG(LOG_INFO) << "Created window: 0x" << hex <<  w << dec << endl << endl;
 
 
 	bool dnd = 0;
+	bool daemon = 0;
+	bool push = 0;
+	bool shm = 0;
+	int transfer_timeout = -1;
 	Atom selection = XA_PRIMARY;
 
 
-	//The 1st command line argument is the selection name. Default is PRIMARY
-	//or alternatively, it can specify DnD operation.
-	if(argc > 1)
+	//The image to offer. All the image formats are produced from this.
+	string image = find_data_file("r0x0r.png");
+
+	//The command line argument is the selection name. Default is PRIMARY
+	//or alternatively, it can specify DnD operation. The image can be
+	//given with -image. -daemon keeps running after the selection is lost,
+	//and -push <image> gives a new image to a running daemon. -timeout
+	//sets how long (in milliseconds) to wait for an INCR requestor to ask
+	//for the next chunk. -shm offers the data through shared memory to
+	//requestors on the same machine.
+	for(int i = 1; i < argc; i++)
 	{
-		if(argv[1] == string("-dnd"))
+		if(argv[i] == string("-dnd"))
 			dnd = 1;
+		else if(argv[i] == string("-daemon"))
+			daemon = 1;
+		else if(argv[i] == string("-shm"))
+			shm = 1;
+		else if(argv[i] == string("-image") && i + 1 < argc)
+			image = absolute_path(argv[++i]);
+		else if(argv[i] == string("-timeout") && i + 1 < argc)
+			transfer_timeout = atoi(argv[++i]);
+		else if(argv[i] == string("-push") && i + 1 < argc)
+		{
+			push = 1;
+			image = absolute_path(argv[++i]);
+		}
 		else
-			selection = XInternAtom(disp, argv[1], 0);
+			register_atom(argv[i], &selection);
 	}
 
 
-	//None of these atoms are provided in Xatom.h
-	XA_TARGETS = XInternAtom(disp, "TARGETS", False);
-	XA_multiple = XInternAtom(disp, "MULTIPLE", False);
-	XA_image_bmp = XInternAtom(disp, "image/bmp", False);
-	XA_image_jpg = XInternAtom(disp, "image/jpeg", False);
-	XA_image_tiff = XInternAtom(disp, "image/tiff", False);
-	XA_image_png = XInternAtom(disp, "image/png", False);
-	XA_text_uri_list = XInternAtom(disp, "text/uri-list", False);
-	XA_text_uri= XInternAtom(disp, "text/uri", False);
-	XA_text_plain = XInternAtom(disp, "text/plain", False);
-	XA_text = XInternAtom(disp, "TEXT", False);
-	XA_XdndSelection = XInternAtom(disp, "XdndSelection", False);
-	XA_XdndAware = XInternAtom(disp, "XdndAware", False);
-	XA_XdndEnter = XInternAtom(disp, "XdndEnter", False);
-	XA_XdndLeave = XInternAtom(disp, "XdndLeave", False);
-	XA_XdndTypeList = XInternAtom(disp, "XdndTypeList", False);
-	XA_XdndPosition = XInternAtom(disp, "XdndPosition", False);
-	XA_XdndActionCopy = XInternAtom(disp, "XdndActionCopy", False);
-	XA_XdndStatus = XInternAtom(disp, "XdndStatus", False);
-	XA_XdndDrop = XInternAtom(disp, "XdndDrop", False);
-	XA_XdndFinished = XInternAtom(disp, "XdndFinished", False);
+	//Get all the atoms we need, which are not provided in Xatom.h
+	intern_atoms(disp);
 
-	//Create a mapping between the data type (specified as an atom) and the
-	//actual data. The data consists of a prespecified list of files in the
-	//current or install directory, and the URL of the PNG, in various
-	//incarnations.
-	map<Atom, string> typed_data; string url;
+	//Timings are dumped on SIGUSR1.
+	init_metrics(disp, "selection");
 
-	typed_data[XA_image_bmp] = read_whole_file("r0x0r.bmp", url);
-	typed_data[XA_image_jpg] = read_whole_file("r0x0r.jpg", url);
-	typed_data[XA_image_tiff] = read_whole_file("r0x0r.tiff", url);
-	typed_data[XA_image_png] = read_whole_file("r0x0r.png", url);
+	if(push)
+	{
+		//The daemon would ignore an image it can't use, so say so here.
+		if(!ConversionEngine::usable_source(image))
+		{
+			LOG(LOG_ERROR) << "Can't read " << image << " or don't know its type.\n";
+			return 1;
+		}
+
+		//Hand the image over to the daemon, if there is one. Otherwise,
+		//we'll have to hold the selection ourselves.
+		Window d = find_daemon(disp, root);
 
-	url = "file://" + url;
+		if(d != None)
+		{
+			LOG(LOG_INFO) << "Pushing " << image << " to daemon 0x" << hex << d << dec << endl;
+			XChangeProperty(disp, d, XA_clipboard_push, selection, 8, PropModeReplace, (unsigned char*)image.c_str(), image.size());
+			XSync(disp, False);
+			return 0;
+		}
+		else
+			LOG(LOG_INFO) << "No daemon is running, so holding the selection instead.\n";
+	}
 
-	typed_data[XA_text_uri_list] = url;
-	typed_data[XA_text_uri] = url;
-	typed_data[XA_text_plain] = url;
-	typed_data[XA_text] = url;
-	typed_data[XA_STRING] = url;
+	EventLoop loop(disp);
 
+	//Create a mapping between the data type (specified as an atom) and the
+	//actual data. The data consists of an image, which is converted to
+	//various formats when (and if) they are asked for, and the URL of the
+	//image, in various incarnations. Conversions run in the background, so
+	//that other requestors aren't kept waiting for them.
+	ConversionEngine typed_data(conversion_cache_size);
+	typed_data.run_in_background(&loop);
+	set_image(typed_data, image);
+
+	SelectionOwner owner(disp, w, typed_data);
+	if(transfer_timeout >= 0)
+		owner.set_transfer_timeout(transfer_timeout);
+	owner.offer_shared_memory(shm);
+
+	//Compressed copies are only made when they're asked for, so they cost
+	//nothing unless a requestor wants one.
+	owner.offer_compression(1);
+
+	DndSource drag(disp, w, root, owner, typed_data);
+
+	if(daemon)
+	{
+		//Listen for pushes, and tell everyone where we are.
+		XSelectInput(disp, w, PropertyChangeMask);
+		XChangeProperty(disp, w, XA_clipboard_daemon, XA_WINDOW, 32, PropModeReplace, (unsigned char*)&w, 1);
+		XChangeProperty(disp, root, XA_clipboard_daemon, XA_WINDOW, 32, PropModeReplace, (unsigned char*)&w, 1);
+		LOG(LOG_INFO) << "Running as a daemon.\n";
+	}
 
 
 	if(dnd)
 	{
 		//We need to map the window to drag from
 		XMapWindow(disp, w);
-		XSelectInput(disp, w, Button1MotionMask | ButtonReleaseMask);
+		XSelectInput(disp, w, DndSource::event_mask | (daemon ? PropertyChangeMask : 0));
 
 		//We set this, so that TARGETS does not need to be called, as
 		//specified by Xdnd.
@@ -336,280 +309,47 @@ int main(int argc, char**argv)
 	else
 	{
 		//All your selection are belong to us...
-		XSetSelectionOwner(disp, selection, w, CurrentTime);
+		owner.own(selection, CurrentTime);
 	}
 
-	XFlush(disp);
-
-
-	bool dragging = 0;                 //Are we currently dragging
-	Window previous_window = 0;        //Window found by the last MotionNotify event.
-	int previous_version = -1;         //XDnD version of previous_window
-	int status = UNAWARE;
-
-
-	//Create three cursors for the three different XDnD states.
-	//I think a turkey is a good choice for a program which doesn't
-	//understand Xdnd.
-	Cursor grab_bad = XCreateFontCursor(disp, XC_gobbler);
-	Cursor grab_maybe = XCreateFontCursor(disp, XC_circle);
-	Cursor grab_good = XCreateFontCursor(disp, XC_sb_down_arrow);
-
 	for(;;)
 	{
-		XNextEvent(disp, &e);
-
-		//Wait until something asks for the selection or until we loose the selection.
-		if(e.type == SelectionClear)
-		{
-			cout  << "SelectionClear event received. Quitting.\n";
-			return 0;
-		}
-		else if(e.type == SelectionRequest)
-		{
-			//A request to paste has occured.
-			process_selection_request(e, typed_data);
-		}
-		else if(e.type == MotionNotify && dragging == 0)
-		{
-			if(XGrabPointer(disp, w, True, Button1MotionMask | ButtonReleaseMask, GrabModeAsync, GrabModeAsync, root, grab_bad, CurrentTime) == GrabSuccess)
-			{
-				dragging = 1;
-				XSetSelectionOwner(disp, XA_XdndSelection, w, CurrentTime);
-				cout << "Begin dragging.\n\n";
-			}
-			else
-				cout << "Grab failed!\n\n";
-		}
-		else if(e.type == MotionNotify)
-		{
-			cout << "Dragged pointer moved: " << endl;
-
-			Window window = 0;
-			Atom atmp;
-			int version = -1;
-			int fmt;
-			unsigned long nitems, bytes_remaining;
-			unsigned char *data = 0;
-
-			//Look for XdndAware in the window under the pointer. So, first,
-			//find the window under the pointer.
-			window = find_app_window(disp, root);
-			cout << "Application window is: 0x" << hex << window << dec << endl;
-
-
-
-			if(window == previous_window)
-				version = previous_version;
-			else if(window == None)
-				;
-			else if(XGetWindowProperty(disp, window, XA_XdndAware, 0, 2, False, AnyPropertyType, &atmp, &fmt, &nitems, &bytes_remaining, &data) != Success)
-				cout << "Property read failed.\n";
-			else if(data == 0)
-				cout << "Property read failed.\n";
-			else if(fmt != 32)
-				cout << "XdndAware should be 32 bits, not " << fmt << " bits\n";
-			else if(nitems != 1)
-				cout << "XdndAware should contain exactly 1 item, not " << nitems << " items\n";
-			else
-			{
-				version = data[0];
-				cout << "XDnD version is " << version << endl;
-			}
-
-			if(status == UNAWARE && version != -1)
-				status = UNRECEPTIVE;
-			else if(version == -1)
-				status = UNAWARE;
-
-			//Update the pointer state.
-			if(status == UNAWARE)
-				XChangeActivePointerGrab(disp, Button1MotionMask | ButtonReleaseMask, grab_bad, CurrentTime);
-			else if(status == UNRECEPTIVE)
-				XChangeActivePointerGrab(disp, Button1MotionMask | ButtonReleaseMask, grab_maybe, CurrentTime);
-			else
-				XChangeActivePointerGrab(disp, Button1MotionMask | ButtonReleaseMask, grab_good, CurrentTime);
-
-
-
-			if(window != previous_window && previous_version != -1)
-			{
-				cout << "Left window 0x" << hex << previous_window  << dec << ": sending XdndLeave\n";
-				//We've left an old, aware window.
-				//Send an XDnD Leave
-
-				XClientMessageEvent m;
-				memset(&m, 0, sizeof(m));
-				m.type = ClientMessage;
-				m.display = e.xclient.display;
-				m.window = previous_window;
-				m.message_type = XA_XdndLeave;
-				m.format = 32;
-				m.data.l[0] = w;
-				m.data.l[1] = 0;
-				m.data.l[2] = 0;
-				m.data.l[3] = 0;
-				m.data.l[4] = 0;
-
-				XSendEvent(disp, previous_window, False, NoEventMask, (XEvent*)&m);
-				XFlush(disp);
-			}
-
-			if(window != previous_window && version != -1)
-			{
-				cout << "Entered window 0x" << hex << window  << dec << ": sending XdndLeave\n";
-				//We've entered a new, aware window.
-				//Send an XDnD Enter event.
-				map<Atom, string>::const_iterator i = typed_data.begin();
-
-				XClientMessageEvent m;
-				memset(&m, 0, sizeof(m));
-				m.type = ClientMessage;
-				m.display = e.xclient.display;
-				m.window = window;
-				m.message_type = XA_XdndEnter;
-				m.format = 32;
-				m.data.l[0] = w;
-				m.data.l[1] = min(5, version) << 24  |  (typed_data.size() > 3);
-				m.data.l[2] = typed_data.size() > 0 ? i++->first : 0;
-				m.data.l[3] = typed_data.size() > 1 ? i++->first : 0;
-				m.data.l[4] = typed_data.size() > 2 ? i->first : 0;
-
-
-				cout << "   version  = " << min(5, version) << endl
-				     << "   >3 types = " << (typed_data.size() > 3) << endl
-					 << "   Type 1   = " << GetAtomName(disp, m.data.l[2]) << endl
-					 << "   Type 2   = " << GetAtomName(disp, m.data.l[3]) << endl
-					 << "   Type 3   = " << GetAtomName(disp, m.data.l[4]) << endl;
-
-				XSendEvent(disp, window, False, NoEventMask, (XEvent*)&m);
-				XFlush(disp);
-			}
-
-			if(version != -1)
-			{
-				//Send an XdndPosition event.
-				//
-				// We're being abusive, and ignoring the
-				// rectangle of silence.
-
-
-				int x, y, tmp;
-				unsigned int utmp;
-				Window wtmp;
-
-				XQueryPointer(disp, window, &wtmp, &wtmp, &x, &y, &tmp, &tmp, &utmp);
-
-
-				XClientMessageEvent m;
-				memset(&m, 0, sizeof(m));
-				m.type = ClientMessage;
-				m.display = e.xclient.display;
-				m.window = window;
-				m.message_type = XA_XdndPosition;
-				m.format = 32;
-				m.data.l[0] = w;
-				m.data.l[1] = 0;
-				m.data.l[2] = (x <<16) | y;
-				m.data.l[3] = CurrentTime; //Our data is not time dependent, so send a generic timestamp;
-				m.data.l[4] = XA_XdndActionCopy;
-
-				cerr << "Sending XdndPosition" << endl
-				     << "    x      = " << x << endl
-				     << "    y      = " << y << endl
-				     << "    Time   = " << m.data.l[3] << endl
-					 << "    Action = " << GetAtomName(disp, m.data.l[4]) << endl;
-
-				XSendEvent(disp, window, False, NoEventMask, (XEvent*)&m);
-				XFlush(disp);
-
-			}
-
-			previous_window = window;
-			previous_version = version;
-			cout << endl;
-		}
-		else if(dragging && e.type == ButtonRelease && e.xbutton.button == 1)
+		//Wait for something to happen, but no longer than the owner can go
+		//without checking on the transfers in progress, since they can
+		//time out, or a drag can go without hearing from the drop target.
+		//SIGUSR1 also interrupts the wait.
+		while(!loop.wait(next_deadline(owner, drag)))
 		{
-			cout << "Mouse button was released.\n";
+			owner.run();
+			drag.check_deadline(metric_now());
+			dump_metrics_if_requested();
 
-
-			if(status == CAN_DROP)
+			if(owner.lost() && !owner.busy() && !daemon)
 			{
-				cout << "Perform drop:\n";
-
-				XClientMessageEvent m;
-				memset(&m, 0, sizeof(m));
-				m.type = ClientMessage;
-				m.display = e.xclient.display;
-				m.window = previous_window;
-				m.message_type = XA_XdndDrop;
-				m.format = 32;
-				m.data.l[0] = w;
-				m.data.l[1] = 0;
-				m.data.l[2] = CurrentTime; //Our data is not time dependent, so send a generic timestamp;
-				m.data.l[3] = 0;
-				m.data.l[4] = 0;
-
-				XSendEvent(disp, previous_window, False, NoEventMask, (XEvent*)&m);
-				XFlush(disp);
+				LOG(LOG_INFO) << "Selection lost and no transfers in progress. Quitting.\n";
+				return 0;
 			}
-
-
-			XUngrabPointer(disp, CurrentTime);
-			dragging = 0;
-			status = UNAWARE;
-			previous_window = None;
-			previous_version = -1;
-			cout << endl;
 		}
-		else if(e.type == ClientMessage && e.xclient.message_type == XA_XdndStatus)
-		{
-			cout  << "XDnDStatus event received:" << endl
-			      << "    Target window           = 0x" << hex << e.xclient.data.l[0] << dec << endl
-			      << "    Will accept             = " << (e.xclient.data.l[1] & 1)  << endl
-			      << "    No rectangle of silence = " << (e.xclient.data.l[1] & 2)  << endl
-			      << "    Rectangle of silence x  = " << (e.xclient.data.l[2] >> 16)    << endl
-			      << "    Rectangle of silence y  = " << (e.xclient.data.l[2] & 0xffff)    << endl
-			      << "    Rectangle of silence w  = " << (e.xclient.data.l[3] >> 16)    << endl
-			      << "    Rectangle of silence h  = " << (e.xclient.data.l[3] & 0xffff)    << endl
-			      << "    Action                  = " << GetAtomName(disp, e.xclient.data.l[4]) << endl;
-
-
-			if( (e.xclient.data.l[1] & 1) == 0 &&  e.xclient.data.l[4] != None)
-			{
-				cout << "Action is given, even though the target won't accept a drop.\n";
-			}
-
 
-			if(dragging)
-			{
-				if((e.xclient.data.l[1]&1) && status != UNAWARE)
-					status = CAN_DROP;
+		XNextEvent(disp, &e);
 
-				if(!(e.xclient.data.l[1]&1) && status != UNAWARE)
-					status = UNRECEPTIVE;
-			}
+		//Every event goes to everything which might be interested.
+		process_push(e, typed_data, owner);
+		owner.handle_event(e);
+		drag.handle_event(e);
 
-			if(!dragging)
-				cout << "Message received, but dragging is not active!\n";
+		//Once all the events which have arrived have been dealt with, send
+		//the next chunk to every requestor which is waiting for one.
+		if(QLength(disp) == 0)
+			owner.run();
 
-			if(status == UNAWARE)
-				cout << "Message received, but we're not in an aware window!\n";
+		dump_metrics_if_requested();
 
-			cout << endl;
-		}
-		else if(e.type == ClientMessage && e.xclient.message_type == XA_XdndFinished)
+		if(owner.lost() && !owner.busy() && !daemon)
 		{
-			//Check for these messages. Since out data is static, we don't need to do anything.
-			cout  << "XDnDFinished event received:" << endl
-			      << "    Target window           = 0x" << hex << e.xclient.data.l[0] << dec << endl
-			      << "    Was successful          = " << (e.xclient.data.l[1] & 1)  << endl
-			      << "    Action                  = " << GetAtomName(disp, e.xclient.data.l[2]) << endl;
-
-			cout  << "No action performed.\n\n";
+			LOG(LOG_INFO) << "Selection lost and no transfers in progress. Quitting.\n";
+			return 0;
 		}
-
 	}
 
 	return 0;
@@ -0,0 +1,189 @@
+#include "shared.h"
+#include "log.h"
+#include <sstream>
+#include <fstream>
+#include <cstring>
+#include <cerrno>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+using namespace std;
+
+//The seals which guarantee that the data can't change under a requestor,
+//which would otherwise be able to crash by reading past the end.
+static const int seals = F_SEAL_SEAL | F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE;
+
+
+string machine_id()
+{
+	static string id;
+
+	if(id.empty())
+	{
+		//The host name alone could be shared by containers, or by
+		//machines on different networks, so the boot ID is added to it.
+		char host[256] = "";
+		gethostname(host, sizeof(host) - 1);
+
+		string boot;
+		ifstream in("/proc/sys/kernel/random/boot_id");
+		in >> boot;
+
+		id = string(host) + "/" + boot;
+	}
+
+	return id;
+}
+
+
+SharedPayloads::SharedPayloads()
+:current_version(0)
+{
+}
+
+
+SharedPayloads::~SharedPayloads()
+{
+	clear();
+}
+
+
+void SharedPayloads::clear()
+{
+	for(map<Atom, Shared>::iterator i = shared.begin(); i != shared.end(); i++)
+		close(i->second.fd);
+
+	shared.clear();
+}
+
+
+string SharedPayloads::handle(Atom target, Payload& data, unsigned long version)
+{
+	if(version != current_version)
+	{
+		clear();
+		current_version = version;
+	}
+
+	map<Atom, Shared>::iterator i = shared.find(target);
+	if(i != shared.end())
+	{
+		i->second.last_used = time(0);
+		return i->second.handle;
+	}
+
+	int fd = memfd_create("x-clipboard", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if(fd == -1)
+	{
+		LOG(LOG_ERROR) << "Could not create a memfd: " << strerror(errno) << endl;
+		return "";
+	}
+
+	//Write the data in, and then seal it.
+	const unsigned char* p = data.data();
+	size_t left = data.size();
+	while(left > 0)
+	{
+		ssize_t n = write(fd, p, left);
+
+		if(n < 0 && errno == EINTR)
+			continue;
+		else if(n <= 0)
+			break;
+
+		p += n;
+		left -= n;
+	}
+
+	struct stat s;
+	if(left != 0 || fcntl(fd, F_ADD_SEALS, seals) == -1 || fstat(fd, &s) == -1)
+	{
+		LOG(LOG_ERROR) << "Could not fill the memfd: " << strerror(errno) << endl;
+		close(fd);
+		return "";
+	}
+
+	ostringstream h;
+	h << machine_id() << " " << getpid() << " " << fd << " " << s.st_ino << " " << data.size();
+
+	Shared sh = {fd, h.str(), time(0)};
+	shared[target] = sh;
+
+	LOG(LOG_INFO) << "Copied " << data.size() << " bytes in to a memfd.\n";
+
+	return sh.handle;
+}
+
+
+void SharedPayloads::release_idle(time_t max_idle)
+{
+	time_t now = time(0);
+
+	for(map<Atom, Shared>::iterator i = shared.begin(); i != shared.end(); )
+	{
+		if(now - i->second.last_used >= max_idle)
+		{
+			close(i->second.fd);
+			shared.erase(i++);
+		}
+		else
+			i++;
+	}
+}
+
+
+bool map_shared(const string& handle, unsigned char*& data, size_t& size)
+{
+	istringstream in(handle);
+	string machine;
+	long pid;
+	int fd;
+	unsigned long inode;
+	size_t len;
+
+	if(!(in >> machine >> pid >> fd >> inode >> len))
+	{
+		LOG(LOG_ERROR) << "Malformed shared memory handle.\n";
+		return false;
+	}
+
+	if(machine != machine_id())
+	{
+		LOG(LOG_INFO) << "The owner is on another machine (" << machine << ").\n";
+		return false;
+	}
+
+	//mmap can not map zero bytes, and there's nothing to gain anyway.
+	if(len == 0)
+		return false;
+
+	ostringstream path;
+	path << "/proc/" << pid << "/fd/" << fd;
+
+	int f = open(path.str().c_str(), O_RDONLY | O_CLOEXEC);
+	if(f == -1)
+	{
+		LOG(LOG_INFO) << "Could not open " << path.str() << ": " << strerror(errno) << endl;
+		return false;
+	}
+
+	//Make sure that it's the memfd we were told about, and that it can't
+	//change while we're reading it.
+	struct stat s;
+	int sealed = fcntl(f, F_GET_SEALS);
+	bool ok = fstat(f, &s) == 0 && s.st_ino == inode && (size_t)s.st_size == len && sealed != -1 && (sealed & seals) == seals;
+
+	void* m = ok ? mmap(0, len, PROT_READ, MAP_SHARED, f, 0) : MAP_FAILED;
+	close(f);
+
+	if(m == MAP_FAILED)
+	{
+		LOG(LOG_INFO) << "Could not map " << path.str() << endl;
+		return false;
+	}
+
+	data = (unsigned char*)m;
+	size = len;
+	return true;
+}
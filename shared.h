@@ -0,0 +1,75 @@
+#ifndef X_CLIPBOARD_SHARED_H
+#define X_CLIPBOARD_SHARED_H
+
+#include <X11/Xlib.h>
+#include <map>
+#include <string>
+#include <ctime>
+#include "payload.h"
+
+//When the owner and the requestor are on the same machine, there's no need
+//to copy the data in to the X server and back out again. Instead, the owner
+//can offer the private target _X_CLIPBOARD_SHM. To use it, the requestor
+//puts the target it actually wants (as a single ATOM) in the property, as a
+//parameter, and converts _X_CLIPBOARD_SHM in to that property, as with
+//MULTIPLE. The owner copies the data in to a memfd, seals it so that it can
+//never change, and replies with a short string of type _X_CLIPBOARD_SHM:
+//
+//   <machine> <pid> <fd> <inode> <size>
+//
+//If the machine is the same as ours, the requestor opens the memfd through
+///proc/<pid>/fd/<fd>, checks that it's the right file (the fd may have been
+//reused), and maps it. Otherwise (or if anything goes wrong), the requestor
+//simply asks for the target in the normal way.
+//
+//Only the handle goes through the server, however large the data is, and
+//there are no INCR transfers.
+
+//Identifies this machine (and this boot of it), so that a handle from
+//another machine is never mistaken for one of ours.
+std::string machine_id();
+
+
+//The owner's side. Each target is copied in to a memfd the first time it's
+//asked for, and the memfd is kept for later requests until the data
+//changes, or it hasn't been asked for in a while.
+class SharedPayloads
+{
+	public:
+		SharedPayloads();
+		~SharedPayloads();
+
+		//The handle for the data of a target. version identifies the
+		//data (eg ConversionEngine::version), and everything made for an
+		//old version is discarded. Returns an empty string if the memfd
+		//could not be made.
+		std::string handle(Atom target, Payload& data, unsigned long version);
+
+		//Close memfds which have not been asked for in max_idle seconds.
+		void release_idle(time_t max_idle);
+
+		void clear();
+
+	private:
+		SharedPayloads(const SharedPayloads&);
+		void operator=(const SharedPayloads&);
+
+		struct Shared
+		{
+			int fd;
+			std::string handle;
+			time_t last_used;
+		};
+
+		std::map<Atom, Shared> shared;
+		unsigned long current_version;
+};
+
+
+//The requestor's side. Map the data described by a handle. Returns false if
+//the handle is from another machine, or the memfd can't be opened, in which
+//case the data has to be asked for in the normal way. The mapping must be
+//released with munmap.
+bool map_shared(const std::string& handle, unsigned char*& data, size_t& size);
+
+#endif
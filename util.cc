@@ -0,0 +1,60 @@
+#include "util.h"
+#include <cstdlib>
+#include <cerrno>
+#include <climits>
+#include <unistd.h>
+using namespace std;
+
+bool parse_timeouts(const char* s, PasteTimeouts& t)
+{
+	int values[3];
+	int n = 0;
+
+	for(;;)
+	{
+		//strtol would skip leading spaces and take a sign, neither of
+		//which belong in a time.
+		if(*s < '0' || *s > '9')
+			return false;
+
+		char* end;
+		errno = 0;
+		long v = strtol(s, &end, 10);
+
+		if(errno != 0 || v > INT_MAX)
+			return false;
+
+		values[n++] = v;
+
+		if(*end == 0)
+			break;
+		else if(*end != ',' || n == 3)
+			return false;
+
+		s = end + 1;
+	}
+
+	t.targets = values[0];
+	t.convert = n > 1 ? values[1] : t.targets;
+	t.incr_chunk = n > 2 ? values[2] : t.convert;
+
+	return true;
+}
+
+bool write_all(int fd, const unsigned char* data, size_t len)
+{
+	while(len > 0)
+	{
+		ssize_t n = write(fd, data, len);
+
+		if(n < 0 && errno == EINTR)
+			continue;
+		else if(n <= 0)
+			return false;
+
+		data += n;
+		len -= n;
+	}
+
+	return true;
+}
@@ -0,0 +1,32 @@
+#ifndef X_CLIPBOARD_UTIL_H
+#define X_CLIPBOARD_UTIL_H
+
+#include <cstddef>
+
+//Small things which don't need X at all, so that they can be shared with
+//paste-xcb, which doesn't use Xlib.
+
+//How long to wait for each phase of a paste, in milliseconds, or 0 to wait
+//forever: the owner's reply to TARGETS, its reply to a conversion, and each
+//chunk of an INCR transfer. An owner which has hung (or a requestor which
+//has given up on an INCR transfer) would otherwise leave the paste waiting
+//forever.
+struct PasteTimeouts
+{
+	int targets;
+	int convert;
+	int incr_chunk;
+};
+
+//Parse the argument to -timeout, which is a time in milliseconds for each
+//phase, as targets,convert,incr_chunk. If fewer are given, the last one is
+//used for the rest, so a single number applies to everything. 0 means wait
+//forever. Returns false (leaving t alone) unless the whole string is one to
+//three non-negative numbers separated by commas.
+bool parse_timeouts(const char* s, PasteTimeouts& t);
+
+//Write all of a buffer to fd, carrying on after partial writes. Returns
+//false if it fails.
+bool write_all(int fd, const unsigned char* data, size_t len);
+
+#endif
@@ -0,0 +1,16 @@
+#include "xclipboard.h"
+using namespace std;
+
+int ignore_x_error(Display*, XErrorEvent*)
+{
+	return 0;
+}
+
+
+int report_x_error(Display* disp, XErrorEvent* e)
+{
+	char buf[256];
+	XGetErrorText(disp, e->error_code, buf, sizeof(buf));
+	LOG(LOG_ERROR) << "X error: " << buf << " (request " << int(e->request_code) << ")\n";
+	return 0;
+}
@@ -0,0 +1,48 @@
+#ifndef X_CLIPBOARD_H
+#define X_CLIPBOARD_H
+
+//libxclipboard: everything paste and selection do, so that other programs
+//can copy, paste and drag and drop in-process, over a connection they keep
+//open, rather than running paste or selection for every operation.
+//
+//None of the objects wait for events. The program runs its own event loop
+//(EventLoop or wait_for_event can be used to do that without blocking
+//forever), hands every event to every object, and calls SelectionOwner::run
+//when the queue is empty. Anything which can time out has a deadline, which
+//the loop should wait no longer than. The objects are:
+//
+//  SelectionOwner      (owner.h)      Holds a selection and answers requests.
+//  SelectionRequester  (requester.h)  Pastes from a selection.
+//  TargetPreferences   (preferences.h) Which targets a paste will accept.
+//  DndSource           (dnd.h)        Drags data from a window.
+//  DndTarget           (dnd.h)        Accepts drops on a window.
+//
+//The loop itself can be an EventLoop (loop.h). The data offered is held in a
+//ConversionEngine (convert.h), which can run slow conversions in the
+//background on the same loop. Requestors on the same machine as the owner
+//can get it through shared memory instead of the X server (shared.h).
+//intern_atoms (atoms.h) must be called before anything else.
+//
+//See paste.cc and selection.cc for complete examples.
+
+#include "atoms.h"
+#include "log.h"
+#include "metrics.h"
+#include "payload.h"
+#include "convert.h"
+#include "shared.h"
+#include "owner.h"
+#include "preferences.h"
+#include "requester.h"
+#include "dnd.h"
+#include "loop.h"
+
+//Errors from requests which are allowed to fail are ignored.
+int ignore_x_error(Display*, XErrorEvent*);
+
+//Errors are reported, but are not fatal. An owner should install this, since
+//requestors can destroy their windows at any time, which would make
+//requests to them fail.
+int report_x_error(Display* disp, XErrorEvent* e);
+
+#endif